@@ -14,80 +14,322 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "drmhwc"
+
 #include "Backend.h"
 
+#include <algorithm>
 #include <climits>
 
 #include "BackendManager.h"
 #include "bufferinfo/BufferInfoGetter.h"
+#include "utils/log.h"
 
 namespace android {
 
-HWC2::Error Backend::ValidateDisplay(HwcDisplay *display, uint32_t *num_types,
-                                     uint32_t *num_requests) {
-  *num_types = 0;
-  *num_requests = 0;
+namespace {
 
-  auto layers = display->GetOrderLayersByZPos();
+/* Plan search cost model. All costs are expressed in "scanned out 32bpp
+ * pixels", i.e. the memory traffic of the display controller fetching one
+ * pixel of an ARGB8888 buffer.
+ */
 
-  int client_start = -1;
-  size_t client_size = 0;
+/* GPU composition of a pixel: source fetch, blending and destination write */
+constexpr uint64_t kGpuPixelCost = 4;
+/* Client target: GPU writes it once, display controller reads it once */
+constexpr uint64_t kClientTargetPixelCost = 2;
+/* Per-frame budget for the plane assignment search */
+constexpr int64_t kPlanSearchBudgetNs = 500 * 1000;
+/* Check the time budget once per this amount of visited search nodes */
+constexpr uint32_t kPlanSearchClockInterval = 64;
+constexpr size_t kMaxSearchPlanes = 64;
+
+auto RectArea(const hwc_rect_t &r) -> uint64_t {
+  if (r.right <= r.left || r.bottom <= r.top)
+    return 0;
+  return uint64_t(r.right - r.left) * uint64_t(r.bottom - r.top);
+}
 
-  auto flatcon = display->GetFlatCon();
-  if (flatcon) {
-    bool should_flatten = false;
-    if (layers.size() <= 1)
-      flatcon->Disable();
-    else
-      should_flatten = flatcon->NewFrame();
+auto RectsIntersect(const hwc_rect_t &a, const hwc_rect_t &b) -> bool {
+  return a.left < b.right && b.left < a.right && a.top < b.bottom &&
+         b.top < a.bottom;
+}
+
+/* Memory traffic (in 32bpp pixels) required to fetch the layer source */
+auto FetchCost(const LayerData &ld) -> uint64_t {
+  auto &crop = ld.pi.source_crop;
+  auto src_w = uint64_t(std::max(crop.right - crop.left, 0.0F));
+  auto src_h = uint64_t(std::max(crop.bottom - crop.top, 0.0F));
+
+  uint64_t bpp = 4;
+  if (ld.bi && ld.bi->width != 0 && ld.bi->pitches[0] != 0)
+    bpp = std::max(ld.bi->pitches[0] / ld.bi->width, 1U);
+
+  return src_w * src_h * bpp / 4;
+}
+
+/* Depth-first branch-and-bound over layer->{plane, client} assignments.
+ *
+ * Layers are visited bottom-up in z-order, which allows to simulate plane
+ * allocation the same way DrmKmsPlan does it (planes are consumed in order,
+ * unsupported ones are skipped). The client target takes one plane at the
+ * z-position of the lowest client layer. A device layer placed above the
+ * client target must not be overlapped by any client layer above it, since
+ * such a layer would otherwise be drawn on top of client composited content.
+ */
+class PlanSearch {
+ public:
+  struct Candidate {
+    bool force_client{};
+    uint64_t device_cost{};
+    uint64_t client_cost{};
+    hwc_rect_t frame{};
+    /* Bit N is set if usable plane N can scan out this layer */
+    uint64_t valid_planes{};
+  };
+
+  PlanSearch(std::vector<Candidate> candidates, size_t num_planes,
+             uint64_t target_cost)
+      : candidates_(std::move(candidates)),
+        num_planes_(num_planes),
+        target_cost_(target_cost),
+        current_(candidates_.size()),
+        best_(candidates_.size(), true),
+        min_tail_cost_(candidates_.size() + 1) {
+    best_cost_ = target_cost_;
+    for (auto &c : candidates_)
+      best_cost_ += c.client_cost;
+
+    for (size_t z = candidates_.size(); z > 0; z--) {
+      auto &c = candidates_[z - 1];
+      auto min_cost = c.force_client ? c.client_cost
+                                     : std::min(c.device_cost, c.client_cost);
+      min_tail_cost_[z - 1] = min_tail_cost_[z] + min_cost;
+    }
+  }
+
+  auto Run() -> std::vector<bool> {
+    deadline_ = ResourceManager::GetTimeMonotonicNs() + kPlanSearchBudgetNs;
+    Step(0, 0, false, 0);
+    if (timed_out_)
+      ALOGV("Plane assignment search ran out of time budget");
+    return best_;
+  }
 
-    if (should_flatten) {
-      display->total_stats().frames_flattened_++;
-      MarkValidated(layers, 0, layers.size());
-      *num_types = layers.size();
-      return HWC2::Error::HasChanges;
+ private:
+  auto TimedOut() -> bool {
+    if (!timed_out_ && ++visited_ % kPlanSearchClockInterval == 0)
+      timed_out_ = ResourceManager::GetTimeMonotonicNs() > deadline_;
+
+    return timed_out_;
+  }
+
+  auto NextValidPlane(uint64_t valid_planes, size_t first) const -> size_t {
+    for (size_t i = first; i < num_planes_; i++) {
+      if ((valid_planes & (1ULL << i)) != 0)
+        return i;
+    }
+    return num_planes_;
+  }
+
+  // NOLINTNEXTLINE(misc-no-recursion)
+  void Step(size_t z, size_t next_plane, bool has_client, uint64_t cost) {
+    if (TimedOut() || cost + min_tail_cost_[z] >= best_cost_)
+      return;
+
+    if (z == candidates_.size()) {
+      best_ = current_;
+      best_cost_ = cost;
+      return;
+    }
+
+    auto &c = candidates_[z];
+
+    if (!c.force_client) {
+      auto plane = NextValidPlane(c.valid_planes, next_plane);
+      if (plane < num_planes_) {
+        current_[z] = false;
+        if (has_client)
+          above_client_.emplace_back(z);
+        Step(z + 1, plane + 1, has_client, cost + c.device_cost);
+        if (has_client)
+          above_client_.pop_back();
+      }
     }
+
+    for (auto device_z : above_client_) {
+      if (RectsIntersect(candidates_[device_z].frame, c.frame))
+        return;
+    }
+
+    if (!has_client) {
+      if (next_plane >= num_planes_)
+        return;
+      next_plane++;
+      cost += target_cost_;
+    }
+
+    current_[z] = true;
+    Step(z + 1, next_plane, true, cost + c.client_cost);
   }
 
-  std::tie(client_start, client_size) = GetClientLayers(display, layers);
+  const std::vector<Candidate> candidates_;
+  const size_t num_planes_;
+  const uint64_t target_cost_;
+
+  std::vector<bool> current_;
+  std::vector<bool> best_;
+  uint64_t best_cost_{};
+  /* Lower bound of the cost of layers [z, end) */
+  std::vector<uint64_t> min_tail_cost_;
+  /* Device layers placed above the client target */
+  std::vector<size_t> above_client_;
+
+  int64_t deadline_{};
+  uint32_t visited_{};
+  bool timed_out_{};
+};
+
+}  // namespace
+
+HWC2::Error Backend::ValidateDisplay(HwcDisplay *display, uint32_t *num_types,
+                                     uint32_t *num_requests) {
+  *num_types = 0;
+  *num_requests = 0;
+
+  const auto &layers = display->GetOrderLayersByZPos();
+  const std::vector<bool> all_client(layers.size(), true);
+
+  std::optional<std::vector<bool>> client_mask;
+  if (display->UpdateFlattening()) {
+    display->total_stats().frames_flattened_++;
+    client_mask = GetFlattenedClientLayers(display, layers);
+    flattened_ = true;
+  } else {
+    client_mask = GetPriorClientLayers(display, layers);
+    if (!client_mask) {
+      client_mask = GetClientLayers(display, layers);
+      flattened_ = false;
+      plane_starved_ = RequestPlanes(display, layers, *client_mask);
+    }
+  }
 
-  MarkValidated(layers, client_start, client_size);
+  MarkValidated(layers, *client_mask);
 
-  auto testing_needed = client_start != 0 || client_size != layers.size();
+  auto testing_needed = *client_mask != all_client;
 
   AtomicCommitArgs a_args = {.test_only = true};
 
+  fallback_ = false;
   if (testing_needed &&
       display->CreateComposition(a_args) != HWC2::Error::None) {
     ++display->total_stats().failed_kms_validate_;
-    client_start = 0;
-    client_size = layers.size();
-    MarkValidated(layers, 0, client_size);
+    client_mask = all_client;
+    MarkValidated(layers, *client_mask);
+    fallback_ = true;
   }
 
-  *num_types = client_size;
+  *num_types = std::count(client_mask->begin(), client_mask->end(), true);
 
-  display->total_stats().gpu_pixops_ += CalcPixOps(layers, client_start,
-                                                   client_size);
-  display->total_stats().total_pixops_ += CalcPixOps(layers, 0, layers.size());
+  display->total_stats().gpu_pixops_ += CalcPixOps(layers, *client_mask);
+  display->total_stats().total_pixops_ += CalcPixOps(layers, all_client);
 
   return *num_types != 0 ? HWC2::Error::HasChanges : HWC2::Error::None;
 }
 
-std::tuple<int, size_t> Backend::GetClientLayers(
+std::vector<bool> Backend::GetClientLayers(
+    HwcDisplay *display, const std::vector<HwcLayer *> &layers) {
+  std::vector<bool> forced_client(layers.size());
+
+  for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
+    auto *layer = layers[z_order];
+    if (!IsClientLayer(display, layer)) {
+      /* Plane capabilities are checked against the buffer information */
+      layer->PopulateLayerData();
+    }
+    forced_client[z_order] = IsClientLayer(display, layer) ||
+                             !layer->GetLayerData().bi;
+  }
+
+  return SearchPlan(display, layers, forced_client);
+}
+
+/* Static layers are merged into the client target, while the frequently
+ * updated ones are kept on the planes if possible.
+ */
+std::vector<bool> Backend::GetFlattenedClientLayers(
+    HwcDisplay *display, const std::vector<HwcLayer *> &layers) {
+  std::vector<bool> forced_client(layers.size(), true);
+
+  for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
+    auto *layer = layers[z_order];
+    if (!layer->IsFrequentlyUpdated() || IsClientLayer(display, layer))
+      continue;
+
+    layer->PopulateLayerData();
+    forced_client[z_order] = !layer->GetLayerData().bi;
+  }
+
+  return SearchPlan(display, layers, forced_client);
+}
+
+/* When only buffers have changed since the last validation, the previous
+ * composition plan is reused. The TEST_ONLY commit still verifies it against
+ * the new buffers.
+ */
+std::optional<std::vector<bool>> Backend::GetPriorClientLayers(
     HwcDisplay *display, const std::vector<HwcLayer *> &layers) {
-  int client_start = -1;
-  size_t client_size = 0;
+  /* Overlays released by other displays are picked up by a new search, a
+   * plan rejected by the TEST_ONLY commit is searched again with new buffers
+   */
+  if (plane_starved_ || fallback_ ||
+      (display->GetDirtyBits() & ~HwcLayer::kDirtyBuffer) != 0)
+    return {};
 
+  std::vector<bool> client_mask(layers.size());
   for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
-    if (IsClientLayer(display, layers[z_order])) {
-      if (client_start < 0)
-        client_start = (int)z_order;
-      client_size = (z_order - client_start) + 1;
+    auto *layer = layers[z_order];
+    switch (layer->GetValidatedType()) {
+      case HWC2::Composition::Client:
+        /* Flattened layers must be recomposed once their content is updated */
+        if (flattened_ && layer->IsContentUpdated())
+          return {};
+        client_mask[z_order] = true;
+        break;
+      case HWC2::Composition::Device:
+        if (IsClientLayer(display, layer))
+          return {};
+        break;
+      default:
+        return {};
     }
   }
 
-  return GetExtraClientRange(display, layers, client_start, client_size);
+  return client_mask;
+}
+
+/* Requests the overlays held by other displays when some layers could have
+ * been scanned out but are client composited.
+ */
+bool Backend::RequestPlanes(HwcDisplay *display,
+                            const std::vector<HwcLayer *> &layers,
+                            const std::vector<bool> &client_mask) {
+  bool has_video = false;
+  size_t starved_layers = 0;
+  for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
+    auto &bi = layers[z_order]->GetLayerData().bi;
+    if (!bi || IsClientLayer(display, layers[z_order]))
+      continue;
+
+    /* Multi-planar buffers are YUV video frames */
+    has_video |= bi->pitches[1] != 0;
+    starved_layers += client_mask[z_order] ? 1 : 0;
+  }
+
+  auto &pipe = display->GetPipe();
+  auto &arbiter = pipe.device->GetPlaneArbiter();
+  arbiter.SetPriority(&pipe, has_video);
+  return arbiter.RequestPlanes(&pipe, starved_layers);
 }
 
 bool Backend::IsClientLayer(HwcDisplay *display, HwcLayer *layer) {
@@ -103,10 +345,10 @@ bool Backend::HardwareSupportsLayerType(HWC2::Composition comp_type) {
 }
 
 uint32_t Backend::CalcPixOps(const std::vector<HwcLayer *> &layers,
-                             size_t first_z, size_t size) {
+                             const std::vector<bool> &client_mask) {
   uint32_t pixops = 0;
   for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
-    if (z_order >= first_z && z_order < first_z + size) {
+    if (client_mask[z_order]) {
       auto &df = layers[z_order]->GetLayerData().pi.display_frame;
       pixops += (df.right - df.left) * (df.bottom - df.top);
     }
@@ -114,59 +356,50 @@ uint32_t Backend::CalcPixOps(const std::vector<HwcLayer *> &layers,
   return pixops;
 }
 
-void Backend::MarkValidated(std::vector<HwcLayer *> &layers,
-                            size_t client_first_z, size_t client_size) {
+void Backend::MarkValidated(const std::vector<HwcLayer *> &layers,
+                            const std::vector<bool> &client_mask) {
   for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
-    if (z_order >= client_first_z && z_order < client_first_z + client_size)
+    if (client_mask[z_order])
       layers[z_order]->SetValidatedType(HWC2::Composition::Client);
     else
       layers[z_order]->SetValidatedType(HWC2::Composition::Device);
   }
 }
 
-std::tuple<int, int> Backend::GetExtraClientRange(
-    HwcDisplay *display, const std::vector<HwcLayer *> &layers,
-    int client_start, size_t client_size) {
+std::vector<bool> Backend::SearchPlan(HwcDisplay *display,
+                                      const std::vector<HwcLayer *> &layers,
+                                      const std::vector<bool> &forced_client) {
   auto planes = display->GetPipe().GetUsablePlanes();
-  size_t avail_planes = planes.size();
+  planes.resize(std::min(planes.size(), kMaxSearchPlanes));
 
-  /*
-   * If more layers then planes, save one plane
-   * for client composited layers
-   */
-  if (avail_planes < display->layers().size())
-    avail_planes--;
-
-  const int extra_client = int(layers.size() - client_size) - int(avail_planes);
-
-  if (extra_client > 0) {
-    int start = 0;
-    size_t steps = 0;
-    if (client_size != 0) {
-      const int prepend = std::min(client_start, extra_client);
-      const int append = std::min(int(layers.size()) -
-                                      int(client_start + client_size),
-                                  extra_client);
-      start = client_start - (int)prepend;
-      client_size += extra_client;
-      steps = 1 + std::min(std::min(append, prepend),
-                           int(layers.size()) - int(start + client_size));
-    } else {
-      client_size = extra_client;
-      steps = 1 + layers.size() - extra_client;
-    }
+  std::vector<PlanSearch::Candidate> candidates(layers.size());
+  for (size_t z_order = 0; z_order < layers.size(); ++z_order) {
+    auto &ld = layers[z_order]->GetLayerData();
+    auto &c = candidates[z_order];
 
-    uint32_t gpu_pixops = UINT32_MAX;
-    for (size_t i = 0; i < steps; i++) {
-      const uint32_t po = CalcPixOps(layers, start + i, client_size);
-      if (po < gpu_pixops) {
-        gpu_pixops = po;
-        client_start = start + int(i);
-      }
+    c.force_client = forced_client[z_order];
+    c.frame = ld.pi.display_frame;
+    c.device_cost = FetchCost(ld);
+    c.client_cost = RectArea(c.frame) * kGpuPixelCost + c.device_cost;
+
+    if (c.force_client)
+      continue;
+
+    for (size_t i = 0; i < planes.size(); i++) {
+      if (planes[i]->Get()->IsValidForLayer(&ld))
+        c.valid_planes |= 1ULL << i;
     }
   }
 
-  return std::make_tuple(client_start, client_size);
+  uint64_t target_cost = 0;
+  const auto *config = display->GetCurrentConfig();
+  if (config != nullptr) {
+    auto &mode = config->mode.GetRawMode();
+    target_cost = uint64_t(mode.hdisplay) * mode.vdisplay *
+                  kClientTargetPixelCost;
+  }
+
+  return PlanSearch(std::move(candidates), planes.size(), target_cost).Run();
 }
 
 // clang-format off
@@ -25,18 +25,35 @@ class Backend {
   virtual ~Backend() = default;
   virtual HWC2::Error ValidateDisplay(HwcDisplay *display, uint32_t *num_types,
                                       uint32_t *num_requests);
-  virtual std::tuple<int, size_t> GetClientLayers(
+  /* Returns a mask (indexed by z-position in |layers|) of the layers which
+   * should be composited by the client. Backends may override this to plug
+   * in a different plane assignment strategy.
+   */
+  virtual std::vector<bool> GetClientLayers(
       HwcDisplay *display, const std::vector<HwcLayer *> &layers);
   virtual bool IsClientLayer(HwcDisplay *display, HwcLayer *layer);
 
  protected:
+  std::vector<bool> GetFlattenedClientLayers(
+      HwcDisplay *display, const std::vector<HwcLayer *> &layers);
+  std::optional<std::vector<bool>> GetPriorClientLayers(
+      HwcDisplay *display, const std::vector<HwcLayer *> &layers);
+  bool RequestPlanes(HwcDisplay *display,
+                     const std::vector<HwcLayer *> &layers,
+                     const std::vector<bool> &client_mask);
   static bool HardwareSupportsLayerType(HWC2::Composition comp_type);
   static uint32_t CalcPixOps(const std::vector<HwcLayer *> &layers,
-                             size_t first_z, size_t size);
-  static void MarkValidated(std::vector<HwcLayer *> &layers,
-                            size_t client_first_z, size_t client_size);
-  static std::tuple<int, int> GetExtraClientRange(
-      HwcDisplay *display, const std::vector<HwcLayer *> &layers,
-      int client_start, size_t client_size);
+                             const std::vector<bool> &client_mask);
+  static void MarkValidated(const std::vector<HwcLayer *> &layers,
+                            const std::vector<bool> &client_mask);
+  static std::vector<bool> SearchPlan(HwcDisplay *display,
+                                      const std::vector<HwcLayer *> &layers,
+                                      const std::vector<bool> &forced_client);
+
+ private:
+  bool flattened_{};
+  bool plane_starved_{};
+  /* The last mask is the all-client fallback of a failed TEST_ONLY commit */
+  bool fallback_{};
 };
 }  // namespace android
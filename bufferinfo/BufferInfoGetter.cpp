@@ -81,6 +81,50 @@ std::optional<BufferUniqueId> BufferInfoGetter::GetUniqueId(
   return static_cast<BufferUniqueId>(sb.st_ino);
 }
 
+auto BufferInfoGetter::GetBoInfoCached(buffer_handle_t handle)
+    -> std::optional<BufferInfo> {
+  auto unique_id = GetUniqueId(handle);
+
+  if (unique_id) {
+    std::optional<BufferInfo> cached;
+    {
+      const std::lock_guard<std::mutex> lock(bo_info_cache_mutex_);
+      auto it = bo_info_cache_.find(*unique_id);
+      if (it != bo_info_cache_.end())
+        cached = it->second;
+    }
+
+    if (cached && UpdateHandleFields(handle, *cached))
+      return cached;
+  }
+
+  auto bi = GetBoInfo(handle);
+  if (!bi || !unique_id)
+    return bi;
+
+  auto entry = *bi;
+  if (!UpdateHandleFields(handle, entry))
+    return bi;
+
+  const std::lock_guard<std::mutex> lock(bo_info_cache_mutex_);
+  /* Entries of the buffers freed without invalidation are dropped here */
+  if (bo_info_cache_.size() >= kBoInfoCacheMaxSize)
+    bo_info_cache_.clear();
+
+  bo_info_cache_[*unique_id] = entry;
+
+  return bi;
+}
+
+void BufferInfoGetter::InvalidateBoInfo(buffer_handle_t handle) {
+  auto unique_id = GetUniqueId(handle);
+  if (!unique_id)
+    return;
+
+  const std::lock_guard<std::mutex> lock(bo_info_cache_mutex_);
+  bo_info_cache_.erase(*unique_id);
+}
+
 int LegacyBufferInfoGetter::Init() {
   const int ret = hw_get_module(
       GRALLOC_HARDWARE_MODULE_ID,
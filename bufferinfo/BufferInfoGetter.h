@@ -19,7 +19,9 @@
 #include <drm/drm_fourcc.h>
 #include <hardware/gralloc.h>
 
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 
 #include "BufferInfo.h"
 #include "drm/DrmDevice.h"
@@ -41,9 +43,33 @@ class BufferInfoGetter {
 
   virtual std::optional<BufferUniqueId> GetUniqueId(buffer_handle_t handle);
 
+  /* Same as GetBoInfo(), but the metadata of the buffers queried before is
+   * taken from the process-wide cache.
+   */
+  auto GetBoInfoCached(buffer_handle_t handle) -> std::optional<BufferInfo>;
+
+  /* Must be called before the buffer is freed */
+  void InvalidateBoInfo(buffer_handle_t handle);
+
   static BufferInfoGetter *GetInstance();
 
   static bool IsDrmFormatRgb(uint32_t drm_format);
+
+ protected:
+  /* Updates the fields of the cached info, which are specific to the handle
+   * (the same buffer can be imported several times). Getters, which don't
+   * implement it, don't use the cache.
+   */
+  virtual bool UpdateHandleFields(buffer_handle_t /*handle*/,
+                                  BufferInfo & /*bo*/) {
+    return false;
+  }
+
+ private:
+  static constexpr size_t kBoInfoCacheMaxSize = 256;
+
+  std::mutex bo_info_cache_mutex_;
+  std::unordered_map<BufferUniqueId, BufferInfo> bo_info_cache_;
 };
 
 class LegacyBufferInfoGetter : public BufferInfoGetter {
@@ -29,5 +29,10 @@ class BufferInfoMapperMetadata : public BufferInfoGetter {
   static int GetFds(buffer_handle_t handle, BufferInfo *bo);
 
   static BufferInfoGetter *CreateInstance();
+
+ protected:
+  bool UpdateHandleFields(buffer_handle_t handle, BufferInfo &bo) override {
+    return GetFds(handle, &bo) == 0;
+  }
 };
 }  // namespace android
@@ -30,18 +30,18 @@ auto DrmKmsPlan::CreateDrmKmsPlan(DrmDisplayPipeline &pipe,
 
   auto avail_planes = pipe.GetUsablePlanes();
 
+  size_t next_plane = 0;
   int z_pos = 0;
   for (auto &dhl : composition) {
     std::shared_ptr<BindingOwner<DrmPlane>> plane;
 
     /* Skip unsupported planes */
     do {
-      if (avail_planes.empty()) {
+      if (next_plane == avail_planes.size()) {
         return {};
       }
 
-      plane = *avail_planes.begin();
-      avail_planes.erase(avail_planes.begin());
+      plane = avail_planes[next_plane++];
     } while (!plane->Get()->IsValidForLayer(&dhl));
 
     LayerToPlaneJoining joining = {
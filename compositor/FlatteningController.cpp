@@ -24,15 +24,27 @@
  * Additionally, flattening also makes more shared planes available for use by
  * other CRTCs.
  *
- * If the client is not updating layers for 1 second, FlatCon triggers a
- * callback to refresh the screen. The compositor should mark all layers to be
- * composed by the client into a single framebuffer using GPU.
+ * If the client is not updating layers for the timeout, FlatCon triggers a
+ * callback to refresh the screen. The compositor should mark the static layers
+ * to be composed by the client into a single framebuffer using GPU.
+ *
+ * Frequently updated layers (a blinking cursor, a clock) would otherwise
+ * prevent any flattening. They are kept on the planes, their updates do not
+ * restart the timeout and do not undo the flattened composition.
+ *
+ * Flattening too early costs an extra refresh and GPU pass for nothing when
+ * the content is updated again shortly, flattening too late wastes memory
+ * bandwidth. The timeout is chosen per display from the histogram of the
+ * gaps between the content updates, maximizing the expected time spent
+ * flattened beyond the payback time.
  */
 
 #define LOG_TAG "drmhwc"
 
 #include "FlatteningController.h"
 
+#include <algorithm>
+
 #include "utils/log.h"
 
 namespace android {
@@ -47,56 +59,164 @@ auto FlatteningController::CreateInstance(FlatConCallbacks &cbks)
    * https://cs.android.com/android/platform/superproject/main/+/cedca652b903e4f4e584e457b5a7038e0825fb94:hardware/interfaces/graphics/composer/aidl/vts/VtsComposerClient.cpp;drc=a2a6deaf5036e081f48379b6573db4465538b5ac;l=604
    */
   fc->Disable();
-  fc->cbks_ = cbks;
 
-  std::thread(&FlatteningController::ThreadFn, fc).detach();
+  auto &timer = GetSharedTimer();
+  auto lock = std::lock_guard<std::mutex>(timer.mutex);
+  fc->cbks_ = cbks;
+  timer.controllers.emplace_back(fc);
 
   return fc;
 }
 
+auto FlatteningController::GetSharedTimer() -> SharedTimer & {
+  /* The thread serves the controllers for the lifetime of the process */
+  static SharedTimer timer;
+  static std::once_flag started;
+  std::call_once(started, []() { std::thread(TimerThreadFn).detach(); });
+
+  return timer;
+}
+
 /* Compositor should call this every frame */
-bool FlatteningController::NewFrame() {
-  bool wake_it = false;
-  auto lock = std::lock_guard<std::mutex>(mutex_);
+bool FlatteningController::NewFrame(bool content_changed) {
+  auto &timer = GetSharedTimer();
+  auto lock = std::lock_guard<std::mutex>(timer.mutex);
 
   if (flatten_next_frame_) {
     flatten_next_frame_ = false;
     return true;
   }
 
-  sleep_until_ = std::chrono::system_clock::now() + kTimeout;
+  /* Keep counting down, or stay flattened until the static content changes */
+  if (!content_changed)
+    return false;
+
+  auto now = Clock::now();
+  if (last_content_change_ != Clock::time_point{})
+    RecordGap(now - last_content_change_);
+  last_content_change_ = now;
+
+  sleep_until_ = now + timeout_;
   if (disabled_) {
-    wake_it = true;
     disabled_ = false;
+    timer.cv.notify_all();
   }
 
-  if (wake_it)
-    cv_.notify_all();
-
   return false;
 }
 
-void FlatteningController::ThreadFn(
-    const std::shared_ptr<FlatteningController> &fc) {
+bool FlatteningController::RequestFlatten() {
+  auto lock = std::lock_guard<std::mutex>(GetSharedTimer().mutex);
+
+  /* Disabled controller is either flattened already or has nothing to do */
+  if (disabled_ || !cbks_.trigger ||
+      Clock::now() - last_content_change_ < kMinTimeout)
+    return false;
+
+  disabled_ = true;
+  flatten_next_frame_ = true;
+  cbks_.trigger();
+
+  return true;
+}
+
+void FlatteningController::RecordGap(Clock::duration gap) {
+  size_t bucket = 0;
+  while (bucket + 1 < kGapBuckets && gap >= kFirstGapBucket * (2 << bucket))
+    bucket++;
+
+  gap_histogram_[bucket]++;
+  if (++gap_samples_ >= kGapHistoryLength) {
+    gap_samples_ = 0;
+    for (auto &count : gap_histogram_) {
+      count /= 2;
+      gap_samples_ += count;
+    }
+  }
+
+  UpdateTimeout();
+}
+
+/* For every candidate timeout (a bucket edge), the gaps longer than it would
+ * be flattened and spend (gap - timeout) flattened, of which the payback time
+ * is spent to compensate the flattening cost. The gaps of a bucket are assumed
+ * to be at the middle of it.
+ */
+void FlatteningController::UpdateTimeout() {
+  if (gap_samples_ < kMinGapSamples) {
+    timeout_ = kDefaultTimeout;
+    return;
+  }
+
+  using Ms = std::chrono::duration<double, std::milli>;
+  auto best_timeout = Clock::duration(kMaxTimeout);
+  double best_gain = 0.0;
+
+  for (size_t candidate = 0; candidate < kGapBuckets; candidate++) {
+    auto timeout = kFirstGapBucket * (1 << candidate);
+    if (timeout < kMinTimeout || timeout > kMaxTimeout)
+      continue;
+
+    double gain = 0.0;
+    for (size_t bucket = candidate; bucket < kGapBuckets; bucket++) {
+      auto lower_edge = Ms(kFirstGapBucket * (1 << bucket));
+      auto gap = bucket + 1 < kGapBuckets ? lower_edge * 1.5 : lower_edge * 2;
+      gain += gap_histogram_[bucket] *
+              (gap - Ms(timeout) - Ms(kFlatteningPayback)).count();
+    }
+
+    if (gain > best_gain) {
+      best_gain = gain;
+      best_timeout = timeout;
+    }
+  }
+
+  if (best_timeout != timeout_) {
+    ALOGV("Flattening timeout %lld ms",
+          (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+              best_timeout)
+              .count());
+  }
+  timeout_ = best_timeout;
+}
+
+void FlatteningController::TimerThreadFn() {
+  auto &timer = GetSharedTimer();
+  std::unique_lock<std::mutex> lock(timer.mutex);
+
   for (;;) {
-    std::unique_lock<std::mutex> lock(fc->mutex_);
-    if (fc.use_count() == 1 || !fc->cbks_.trigger)
-      break;
-
-    if (fc->sleep_until_ <= std::chrono::system_clock::now() &&
-        !fc->disabled_) {
-      fc->disabled_ = true;
-      fc->flatten_next_frame_ = true;
-      ALOGV("Timeout. Sending an event to compositor");
-      fc->cbks_.trigger();
+    auto now = Clock::now();
+    auto wake_at = Clock::time_point::max();
+
+    auto &controllers = timer.controllers;
+    controllers.erase(std::remove_if(controllers.begin(), controllers.end(),
+                                     [](const auto &fc) {
+                                       return fc.expired();
+                                     }),
+                      controllers.end());
+
+    for (auto &weak_fc : controllers) {
+      auto fc = weak_fc.lock();
+      if (!fc || !fc->cbks_.trigger || fc->disabled_)
+        continue;
+
+      if (fc->sleep_until_ <= now) {
+        fc->disabled_ = true;
+        fc->flatten_next_frame_ = true;
+        ALOGV("Timeout. Sending an event to compositor");
+        fc->cbks_.trigger();
+        continue;
+      }
+
+      wake_at = std::min(wake_at, fc->sleep_until_);
     }
 
-    if (fc->disabled_) {
+    if (wake_at == Clock::time_point::max()) {
       ALOGV("Wait");
-      fc->cv_.wait(lock);
+      timer.cv.wait(lock);
     } else {
       ALOGV("Wait_until");
-      fc->cv_.wait_until(lock, fc->sleep_until_);
+      timer.cv.wait_until(lock, wake_at);
     }
   }
 }
@@ -16,13 +16,19 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 namespace android {
 
+// NOLINTNEXTLINE(misc-unused-using-decls): False positive
+using std::chrono_literals::operator""ms;
 // NOLINTNEXTLINE(misc-unused-using-decls): False positive
 using std::chrono_literals::operator""s;
 
@@ -32,39 +38,93 @@ struct FlatConCallbacks {
 
 class FlatteningController {
  public:
+  using Clock = std::chrono::steady_clock;
+
   static auto CreateInstance(FlatConCallbacks &cbks)
       -> std::shared_ptr<FlatteningController>;
 
   void Disable() {
-    auto lock = std::lock_guard<std::mutex>(mutex_);
+    auto lock = std::lock_guard<std::mutex>(GetSharedTimer().mutex);
     flatten_next_frame_ = false;
     disabled_ = true;
   }
 
-  /* Compositor should call this every frame */
-  bool NewFrame();
+  /* Compositor should call this every frame. Only the content changes of
+   * the layers that are subject to flattening restart the timeout.
+   */
+  bool NewFrame(bool content_changed);
+
+  /* Flattens the display ahead of the timeout if its static content has not
+   * changed for kMinTimeout. Returns false if there is nothing to flatten.
+   */
+  bool RequestFlatten();
 
   auto ShouldFlatten() const {
+    auto lock = std::lock_guard<std::mutex>(GetSharedTimer().mutex);
     return flatten_next_frame_;
   }
 
   void StopThread() {
-    auto lock = std::lock_guard<std::mutex>(mutex_);
+    auto &timer = GetSharedTimer();
+    auto lock = std::lock_guard<std::mutex>(timer.mutex);
     cbks_ = {};
-    cv_.notify_all();
+    timer.cv.notify_all();
+  }
+
+  /* Idle time after which the display is flattened, learned from the gaps
+   * between the content updates.
+   */
+  auto GetTimeout() const -> Clock::duration {
+    auto lock = std::lock_guard<std::mutex>(GetSharedTimer().mutex);
+    return timeout_;
   }
 
-  static constexpr auto kTimeout = 1s;
+  static constexpr auto kDefaultTimeout = 1s;
+  static constexpr auto kMinTimeout = 256ms;
+  static constexpr auto kMaxTimeout = 4096ms;
+  /* Layers updated at least twice within this interval are not flattened */
+  static constexpr auto kFrequentUpdateInterval = 2 * kDefaultTimeout;
 
  private:
+  /* Log2 histogram of the gaps between the content updates, the lower edge
+   * of bucket N is (kFirstGapBucket << N).
+   */
+  static constexpr auto kFirstGapBucket = 16ms;
+  static constexpr size_t kGapBuckets = 10;
+  /* The counts are halved once this many gaps are recorded, so the policy
+   * follows the changes of the usage pattern.
+   */
+  static constexpr uint32_t kGapHistoryLength = 64;
+  /* Gaps recorded before the default timeout is replaced */
+  static constexpr uint32_t kMinGapSamples = 8;
+  /* The time the flattened composition must be kept on the screen to save
+   * more memory bandwidth than the extra refresh and GPU pass cost.
+   */
+  static constexpr auto kFlatteningPayback = 100ms;
+
+  /* All controllers are served by a single timer thread. Its mutex also
+   * guards the state of every controller.
+   */
+  struct SharedTimer {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::weak_ptr<FlatteningController>> controllers;
+  };
+
   FlatteningController() = default;
-  static void ThreadFn(const std::shared_ptr<FlatteningController> &fc);
+  static auto GetSharedTimer() -> SharedTimer &;
+  static void TimerThreadFn();
+
+  void RecordGap(Clock::duration gap);
+  void UpdateTimeout();
 
   bool flatten_next_frame_{};
   bool disabled_{};
-  decltype(std::chrono::system_clock::now()) sleep_until_{};
-  std::mutex mutex_;
-  std::condition_variable cv_;
+  Clock::time_point sleep_until_{};
+  Clock::time_point last_content_change_{};
+  Clock::duration timeout_ = kDefaultTimeout;
+  std::array<uint32_t, kGapBuckets> gap_histogram_{};
+  uint32_t gap_samples_{};
   FlatConCallbacks cbks_;
 };
 
@@ -26,6 +26,8 @@
 #include <utils/Trace.h>
 
 #include <cassert>
+#include <cstring>
+#include <utility>
 
 #include "drm/DrmCrtc.h"
 #include "drm/DrmDevice.h"
@@ -66,9 +68,25 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
     args.active = true;
   }
 
+  auto *drm = pipe_->device;
+
+  std::vector<uint64_t> test_fingerprint;
+  if (args.test_only) {
+    /* Another CRTC of the device has committed since */
+    auto generation = drm->GetCommitGeneration();
+    if (generation != test_commit_generation_) {
+      ClearTestCommitCache();
+      test_commit_generation_ = generation;
+    }
+
+    test_fingerprint = GetTestCommitFingerprint(args);
+    if (LookupTestCommit(test_fingerprint)) {
+      return 0;
+    }
+  }
+
   auto new_frame_state = NewFrameState();
 
-  auto *drm = pipe_->device;
   auto *connector = pipe_->connector->Get();
   auto *crtc = pipe_->crtc->Get();
 
@@ -78,6 +96,27 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
     return -ENOMEM;
   }
 
+  /* Planes, which properties are added to the request */
+  std::vector<DrmPlane *> request_planes;
+  if (args.composition) {
+    for (auto &joining : args.composition->plan)
+      request_planes.emplace_back(joining.plane->Get());
+    for (auto &plane : new_frame_state.used_planes)
+      request_planes.emplace_back(plane->Get());
+  }
+
+  /* Drop the values left by the prior not committed requests */
+  crtc->ClearPendingState();
+  connector->ClearPendingState();
+
+  /* Set the complete state after modeset */
+  if (args.display_mode || args.active) {
+    crtc->ResetState();
+    connector->ResetState();
+    for (auto *plane : request_planes)
+      plane->ResetState();
+  }
+
   int out_fence = -1;
   if (!args.writeback_fb) {
     if (!crtc->GetOutFencePtrProperty().  //
@@ -141,12 +180,14 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
 
   if (args.colorspace && connector->GetColorspaceProperty()) {
     if (!connector->GetColorspaceProperty()
-             .AtomicSet(*pset, connector->GetColorspacePropertyValue(*args.colorspace)))
+             .AtomicSetIfChanged(*pset, connector->GetColorspacePropertyValue(
+                                            *args.colorspace)))
       return -EINVAL;
   }
 
   if (args.content_type && connector->GetContentTypeProperty()) {
-    if (!connector->GetContentTypeProperty().AtomicSet(*pset, *args.content_type))
+    if (!connector->GetContentTypeProperty()
+             .AtomicSetIfChanged(*pset, *args.content_type))
       return -EINVAL;
   }
 
@@ -184,21 +225,32 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
   uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
 
   if (args.test_only) {
-    return drmModeAtomicCommit(*drm->GetFd(), pset.get(),
-                               flags | DRM_MODE_ATOMIC_TEST_ONLY, drm);
+    auto err = drmModeAtomicCommit(*drm->GetFd(), pset.get(),
+                                   flags | DRM_MODE_ATOMIC_TEST_ONLY, drm);
+    if (err == 0)
+      StoreTestCommit(std::move(test_fingerprint));
+    return err;
   }
 
-  if (last_present_fence_) {
+  SharedFd prior_fence;
+  {
+    const std::unique_lock lock(mutex_);
+    prior_fence = last_present_fence_;
+  }
+
+  if (prior_fence) {
     // NOLINTNEXTLINE(misc-const-correctness)
     ATRACE_NAME("WaitPriorFramePresented");
 
     constexpr int kTimeoutMs = 500;
-    const int err = sync_wait(*last_present_fence_, kTimeoutMs);
+    const int err = sync_wait(*prior_fence, kTimeoutMs);
     if (err != 0) {
-      ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *last_present_fence_,
-            err, errno);
+      ALOGE("sync_wait(fd=%i) returned: %i (errno: %i)", *prior_fence, err,
+            errno);
     }
 
+    /* The cleanup thread needs the state lock, it could not run meanwhile */
+    const std::unique_lock lock(mutex_);
     CleanupPriorFrameResources();
   }
 
@@ -210,11 +262,32 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
 
   if (err != 0) {
     ALOGE("Failed to commit pset ret=%d\n", err);
+    crtc->ResetState();
+    connector->ResetState();
+    for (auto *plane : request_planes)
+      plane->ResetState();
     return err;
   }
 
+  crtc->CommitState();
+  connector->CommitState();
+  for (auto *plane : request_planes)
+    plane->CommitState();
+
+  /* Own commits keep the cached results, the fingerprint covers the state
+   * of this CRTC
+   */
+  auto generation = drm->BumpCommitGeneration();
+  if (generation == test_commit_generation_ + 1)
+    test_commit_generation_ = generation;
+
   args.out_fence = MakeSharedFd(out_fence);
 
+  if (args.display_mode) {
+    /* Results of the prior test commits were obtained for another mode */
+    ClearTestCommitCache();
+  }
+
   if (nonblock) {
     {
       const std::unique_lock lock(mutex_);
@@ -233,7 +306,6 @@ auto DrmAtomicStateManager::CommitFrame(AtomicCommitArgs &args) -> int {
 void DrmAtomicStateManager::ThreadFn(
     const std::shared_ptr<DrmAtomicStateManager> &dasm) {
   int tracking_at_the_moment = -1;
-  auto &main_mutex = pipe_->device->GetResMan().GetMainLock();
 
   for (;;) {
     SharedFd present_fence;
@@ -267,7 +339,7 @@ void DrmAtomicStateManager::ThreadFn(
     }
 
     {
-      const std::unique_lock mlk(main_mutex);
+      const std::unique_lock slk(state_mutex_);
       const std::unique_lock lk(mutex_);
       if (exit_thread_)
         break;
@@ -281,6 +353,7 @@ void DrmAtomicStateManager::ThreadFn(
   ALOGI("DrmAtomicStateManager thread exit");
 }
 
+/* Must be called with both state_mutex_ and mutex_ held */
 void DrmAtomicStateManager::CleanupPriorFrameResources() {
   assert(frames_staged_ - frames_tracked_ == 1);
   assert(last_present_fence_);
@@ -293,12 +366,19 @@ void DrmAtomicStateManager::CleanupPriorFrameResources() {
 }
 
 auto DrmAtomicStateManager::ExecuteAtomicCommit(AtomicCommitArgs &args) -> int {
+  const std::unique_lock lock(state_mutex_);
+  return CommitOrCleanup(args);
+}
+
+auto DrmAtomicStateManager::CommitOrCleanup(AtomicCommitArgs &args) -> int {
   auto err = CommitFrame(args);
 
   if (!args.test_only) {
     if (err != 0) {
       ALOGE("Composite failed for pipeline %s",
             pipe_->connector->Get()->GetName().c_str());
+      /* The frame could have passed the test using a cached result */
+      ClearTestCommitCache();
       // Disable the hw used by the last active composition. This allows us to
       // signal the release fences from that composition to avoid hanging.
       AtomicCommitArgs cl_args{};
@@ -312,7 +392,134 @@ auto DrmAtomicStateManager::ExecuteAtomicCommit(AtomicCommitArgs &args) -> int {
   }
 
   return err;
-}  // namespace android
+}
+
+/* Collects every input of the atomic request, which may affect the TEST_ONLY
+ * commit result. Framebuffer IDs and fences are intentionally left out, since
+ * buffers of the same size, layout and format are interchangeable. The state
+ * of the other CRTCs is covered by the device commit generation.
+ */
+auto DrmAtomicStateManager::GetTestCommitFingerprint(
+    const AtomicCommitArgs &args) const -> std::vector<uint64_t> {
+  std::vector<uint64_t> fp;
+
+  auto add_float = [&fp](float value) {
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    fp.emplace_back(bits);
+  };
+
+  auto add_rect = [&fp](const hwc_rect_t &rect) {
+    fp.insert(fp.end(), {uint64_t(rect.left), uint64_t(rect.top),
+                         uint64_t(rect.right), uint64_t(rect.bottom)});
+  };
+
+  fp.emplace_back(args.active ? (*args.active ? 2 : 1) : 0);
+  fp.emplace_back(args.colorspace ? uint64_t(*args.colorspace) + 1 : 0);
+  fp.emplace_back(args.content_type ? uint64_t(*args.content_type) + 1 : 0);
+  fp.emplace_back(args.writeback_fb ? 1 : 0);
+
+  if (args.display_mode) {
+    auto &m = args.display_mode->GetRawMode();
+    fp.insert(fp.end(), {m.clock, m.hdisplay, m.hsync_start, m.hsync_end,
+                         m.htotal, m.vdisplay, m.vsync_start, m.vsync_end,
+                         m.vtotal, m.flags});
+  } else {
+    fp.emplace_back(0);
+  }
+
+  if (args.color_matrix) {
+    fp.insert(fp.end(), std::begin(args.color_matrix->matrix),
+              std::end(args.color_matrix->matrix));
+  } else {
+    fp.emplace_back(0);
+  }
+
+  /* Planes to be disabled */
+  for (const auto &plane : active_frame_state_.used_planes) {
+    fp.emplace_back(plane->Get()->GetId());
+  }
+
+  if (!args.composition) {
+    return fp;
+  }
+
+  for (const auto &joining : args.composition->plan) {
+    const auto &layer = joining.layer;
+    fp.emplace_back(joining.plane->Get()->GetId());
+    fp.emplace_back(joining.z_pos);
+
+    if (layer.bi) {
+      const auto &bi = layer.bi.value();
+      fp.insert(fp.end(), {bi.width, bi.height, bi.format,
+                           uint64_t(bi.color_space), uint64_t(bi.sample_range),
+                           uint64_t(bi.blend_mode)});
+      fp.insert(fp.end(), std::begin(bi.pitches), std::end(bi.pitches));
+      fp.insert(fp.end(), std::begin(bi.offsets), std::end(bi.offsets));
+      fp.insert(fp.end(), std::begin(bi.modifiers), std::end(bi.modifiers));
+    }
+
+    fp.emplace_back(layer.pi.transform);
+    fp.emplace_back(layer.pi.alpha);
+    add_float(layer.pi.source_crop.left);
+    add_float(layer.pi.source_crop.top);
+    add_float(layer.pi.source_crop.right);
+    add_float(layer.pi.source_crop.bottom);
+    add_rect(layer.pi.display_frame);
+  }
+
+  return fp;
+}
+
+static auto HashFingerprint(const std::vector<uint64_t> &fingerprint)
+    -> size_t {
+  size_t hash = fingerprint.size();
+  for (auto word : fingerprint) {
+    hash ^= std::hash<uint64_t>{}(word) + 0x9e3779b97f4a7c15 + (hash << 6) +
+            (hash >> 2);
+  }
+  return hash;
+}
+
+auto DrmAtomicStateManager::LookupTestCommit(
+    const std::vector<uint64_t> &fingerprint) -> bool {
+  auto it = test_commit_index_.find(HashFingerprint(fingerprint));
+  if (it == test_commit_index_.end() ||
+      it->second->fingerprint != fingerprint) {
+    return false;
+  }
+
+  /* Move to the front of the LRU list */
+  test_commit_lru_.splice(test_commit_lru_.begin(), test_commit_lru_,
+                          it->second);
+  return true;
+}
+
+void DrmAtomicStateManager::StoreTestCommit(
+    std::vector<uint64_t> fingerprint) {
+  auto hash = HashFingerprint(fingerprint);
+
+  auto it = test_commit_index_.find(hash);
+  if (it != test_commit_index_.end()) {
+    test_commit_lru_.erase(it->second);
+    test_commit_index_.erase(it);
+  }
+
+  if (test_commit_lru_.size() >= kTestCommitCacheSize) {
+    auto &lru = test_commit_lru_.back();
+    test_commit_index_.erase(HashFingerprint(lru.fingerprint));
+    test_commit_lru_.pop_back();
+  }
+
+  test_commit_lru_.emplace_front(
+      TestCommitCacheEntry{.fingerprint = std::move(fingerprint)});
+  test_commit_index_[hash] = test_commit_lru_.begin();
+}
+
+void DrmAtomicStateManager::ClearTestCommitCache() {
+  test_commit_lru_.clear();
+  test_commit_index_.clear();
+}
 
 auto DrmAtomicStateManager::ActivateDisplayUsingDPMS() -> int {
   return drmModeConnectorSetProperty(*pipe_->device->GetFd(),
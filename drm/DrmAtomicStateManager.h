@@ -18,8 +18,10 @@
 
 #include <pthread.h>
 
+#include <list>
 #include <memory>
 #include <optional>
+#include <unordered_map>
 
 #include "compositor/DisplayInfo.h"
 #include "compositor/DrmKmsPlan.h"
@@ -74,6 +76,7 @@ class DrmAtomicStateManager {
  private:
   DrmAtomicStateManager() = default;
   auto CommitFrame(AtomicCommitArgs &args) -> int;
+  auto CommitOrCleanup(AtomicCommitArgs &args) -> int;
 
   struct KmsState {
     /* Required to cleanup unused planes */
@@ -103,7 +106,28 @@ class DrmAtomicStateManager {
 
   void CleanupPriorFrameResources();
 
+  /* Passed TEST_ONLY commits. Identical layer stacks are validated once,
+   * until any other CRTC of the device commits. Failures are not stored,
+   * they may be transient.
+   */
+  static constexpr size_t kTestCommitCacheSize = 16;
+  struct TestCommitCacheEntry {
+    std::vector<uint64_t> fingerprint;
+  };
+  auto GetTestCommitFingerprint(const AtomicCommitArgs &args) const
+      -> std::vector<uint64_t>;
+  auto LookupTestCommit(const std::vector<uint64_t> &fingerprint) -> bool;
+  void StoreTestCommit(std::vector<uint64_t> fingerprint);
+  void ClearTestCommitCache();
+
+  std::list<TestCommitCacheEntry> test_commit_lru_;
+  /* Device commit generation the cached results were obtained with */
+  uint64_t test_commit_generation_{};
+  std::unordered_map<size_t, std::list<TestCommitCacheEntry>::iterator>
+      test_commit_index_;
+
   KmsState staged_frame_state_;
+  /* Guarded by mutex_, written with state_mutex_ held as well */
   SharedFd last_present_fence_;
   int frames_staged_{};
   int frames_tracked_{};
@@ -111,6 +135,10 @@ class DrmAtomicStateManager {
   void ThreadFn(const std::shared_ptr<DrmAtomicStateManager> &dasm);
   std::condition_variable cv_;
   std::mutex mutex_;
+  /* Guards the frame states against the cleanup thread. Taken before
+   * mutex_.
+   */
+  std::mutex state_mutex_;
   bool exit_thread_{};
 };
 
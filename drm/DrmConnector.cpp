@@ -306,4 +306,24 @@ std::optional<PanelOrientation> DrmConnector::GetPanelOrientation() {
   return {};
 }
 
+auto DrmConnector::GetStateProperties() -> std::array<DrmProperty *, 3> {
+  return {&crtc_id_property_, &colorspace_property_,
+          &content_type_property_};
+}
+
+void DrmConnector::ClearPendingState() {
+  for (auto *prop : GetStateProperties())
+    prop->ClearPendingValue();
+}
+
+void DrmConnector::CommitState() {
+  for (auto *prop : GetStateProperties())
+    prop->CommitPendingValue();
+}
+
+void DrmConnector::ResetState() {
+  for (auto *prop : GetStateProperties())
+    prop->InvalidateCommittedValue();
+}
+
 }  // namespace android
@@ -18,6 +18,7 @@
 
 #include <xf86drmMode.h>
 
+#include <array>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -89,7 +90,7 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
     return dpms_property_;
   }
 
-  auto &GetCrtcIdProperty() const {
+  auto &GetCrtcIdProperty() {
     return crtc_id_property_;
   }
 
@@ -97,7 +98,7 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
     return edid_property_;
   }
 
-  auto &GetColorspaceProperty() const {
+  auto &GetColorspaceProperty() {
     return colorspace_property_;
   }
 
@@ -105,15 +106,15 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
     return colorspace_enum_map_[c];
   }
 
-  auto &GetContentTypeProperty() const {
+  auto &GetContentTypeProperty() {
     return content_type_property_;
   }
 
-  auto &GetWritebackFbIdProperty() const {
+  auto &GetWritebackFbIdProperty() {
     return writeback_fb_id_;
   }
 
-  auto &GetWritebackOutFenceProperty() const {
+  auto &GetWritebackOutFenceProperty() {
     return writeback_out_fence_;
   }
 
@@ -135,6 +136,11 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
 
   auto GetPanelOrientation() -> std::optional<PanelOrientation>;
 
+  /* Shadows of the property values, see DrmProperty::AtomicSet() */
+  void ClearPendingState();
+  void CommitState();
+  void ResetState();
+
  private:
   DrmConnector(DrmModeConnectorUnique connector, DrmDevice *drm, uint32_t index)
       : connector_(std::move(connector)),
@@ -147,6 +153,7 @@ class DrmConnector : public PipelineBindable<DrmConnector> {
   auto Init() -> bool;
   auto GetConnectorProperty(const char *prop_name, DrmProperty *property,
                             bool is_optional = false) -> bool;
+  auto GetStateProperties() -> std::array<DrmProperty *, 3>;
 
   const uint32_t index_in_res_array_;
 
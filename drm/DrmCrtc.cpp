@@ -69,4 +69,23 @@ auto DrmCrtc::CreateInstance(DrmDevice &dev, uint32_t crtc_id, uint32_t index)
   return c;
 }
 
+auto DrmCrtc::GetStateProperties() -> std::array<DrmProperty *, 3> {
+  return {&active_property_, &mode_property_, &ctm_property_};
+}
+
+void DrmCrtc::ClearPendingState() {
+  for (auto *prop : GetStateProperties())
+    prop->ClearPendingValue();
+}
+
+void DrmCrtc::CommitState() {
+  for (auto *prop : GetStateProperties())
+    prop->CommitPendingValue();
+}
+
+void DrmCrtc::ResetState() {
+  for (auto *prop : GetStateProperties())
+    prop->InvalidateCommittedValue();
+}
+
 }  // namespace android
@@ -18,6 +18,7 @@
 
 #include <xf86drmMode.h>
 
+#include <array>
 #include <cstdint>
 
 #include "DrmDisplayPipeline.h"
@@ -46,26 +47,33 @@ class DrmCrtc : public PipelineBindable<DrmCrtc> {
     return index_in_res_array_;
   }
 
-  auto &GetActiveProperty() const {
+  auto &GetActiveProperty() {
     return active_property_;
   }
 
-  auto &GetModeProperty() const {
+  auto &GetModeProperty() {
     return mode_property_;
   }
 
-  auto &GetOutFencePtrProperty() const {
+  auto &GetOutFencePtrProperty() {
     return out_fence_ptr_property_;
   }
 
-  auto &GetCtmProperty() const {
+  auto &GetCtmProperty() {
     return ctm_property_;
   }
 
+  /* Shadows of the property values, see DrmProperty::AtomicSet() */
+  void ClearPendingState();
+  void CommitState();
+  void ResetState();
+
  private:
   DrmCrtc(DrmModeCrtcUnique crtc, uint32_t index)
       : crtc_(std::move(crtc)), index_in_res_array_(index){};
 
+  auto GetStateProperties() -> std::array<DrmProperty *, 3>;
+
   DrmModeCrtcUnique crtc_;
 
   const uint32_t index_in_res_array_;
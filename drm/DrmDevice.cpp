@@ -26,7 +26,9 @@
 #include <string>
 
 #include "drm/DrmAtomicStateManager.h"
+#include "drm/DrmEventListener.h"
 #include "drm/DrmPlane.h"
+#include "drm/DrmPlaneArbiter.h"
 #include "drm/ResourceManager.h"
 #include "utils/log.h"
 #include "utils/properties.h"
@@ -63,6 +65,8 @@ auto DrmDevice::CreateInstance(std::string const &path,
 
 DrmDevice::DrmDevice(ResourceManager *res_man) : res_man_(res_man) {
   drm_fb_importer_ = std::make_unique<DrmFbImporter>(*this);
+  fb_import_worker_ = DrmFbImportWorker::CreateInstance(*this);
+  plane_arbiter_ = std::make_unique<DrmPlaneArbiter>(*this);
 }
 
 auto DrmDevice::Init(const char *path) -> int {
@@ -170,6 +174,8 @@ auto DrmDevice::Init(const char *path) -> int {
     }
   }
 
+  event_listener_ = DrmEventListener::CreateInstance(*this);
+
   return 0;
 }
 
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <map>
 #include <tuple>
@@ -27,8 +28,11 @@
 
 namespace android {
 
+class DrmEventListener;
 class DrmFbImporter;
+class DrmFbImportWorker;
 class DrmPlane;
+class DrmPlaneArbiter;
 class ResourceManager;
 
 class DrmDevice {
@@ -74,6 +78,30 @@ class DrmDevice {
     return *drm_fb_importer_;
   }
 
+  auto &GetFbImportWorker() {
+    return *fb_import_worker_;
+  }
+
+  /* nullptr if the DRM events can't be read */
+  auto GetEventListener() {
+    return event_listener_.get();
+  }
+
+  auto &GetPlaneArbiter() {
+    return *plane_arbiter_;
+  }
+
+  /* Bumped by every commit of any CRTC of the device. The CRTCs share the
+   * planes and the bandwidth, so a TEST_ONLY result obtained before may no
+   * longer hold. Returns the generation following the commit.
+   */
+  auto GetCommitGeneration() const -> uint64_t {
+    return commit_generation_;
+  }
+  auto BumpCommitGeneration() -> uint64_t {
+    return ++commit_generation_;
+  }
+
   auto FindCrtcById(uint32_t id) const -> DrmCrtc * {
     for (const auto &crtc : crtcs_) {
       if (crtc->GetId() == id) {
@@ -117,6 +145,14 @@ class DrmDevice {
   bool HasAddFb2ModifiersSupport_{};
 
   std::unique_ptr<DrmFbImporter> drm_fb_importer_;
+  /* Uses the importer, must be destroyed first */
+  std::unique_ptr<DrmFbImportWorker> fb_import_worker_;
+
+  std::unique_ptr<DrmEventListener> event_listener_;
+
+  std::unique_ptr<DrmPlaneArbiter> plane_arbiter_;
+
+  std::atomic<uint64_t> commit_generation_{};
 
   ResourceManager *const res_man_;
 };
@@ -24,6 +24,7 @@
 #include "DrmDevice.h"
 #include "DrmEncoder.h"
 #include "DrmPlane.h"
+#include "DrmPlaneArbiter.h"
 #include "utils/log.h"
 #include "utils/properties.h"
 
@@ -33,7 +34,10 @@ template <class O>
 auto PipelineBindable<O>::BindPipeline(DrmDisplayPipeline *pipeline,
                                        bool return_object_if_bound)
     -> std::shared_ptr<BindingOwner<O>> {
-  auto owner_object = owner_object_.lock();
+  /* Released after the lock, the last reference runs ~BindingOwner() */
+  std::shared_ptr<BindingOwner<O>> owner_object;
+  const std::lock_guard<std::mutex> lock(binding_mutex_);
+  owner_object = owner_object_.lock();
   if (owner_object) {
     if (bound_pipeline_ == pipeline && return_object_if_bound) {
       return owner_object;
@@ -164,16 +168,8 @@ auto DrmDisplayPipeline::GetUsablePlanes()
   planes.emplace_back(primary_plane);
 
   if (Properties::UseOverlayPlanes()) {
-    for (const auto &plane : device->GetPlanes()) {
-      if (plane->IsCrtcSupported(*crtc->Get())) {
-        if (plane->GetType() == DRM_PLANE_TYPE_OVERLAY) {
-          auto op = plane->BindPipeline(this, true);
-          if (op) {
-            planes.emplace_back(op);
-          }
-        }
-      }
-    }
+    auto overlays = device->GetPlaneArbiter().LeaseOverlays(*this);
+    planes.insert(planes.end(), overlays.begin(), overlays.end());
   }
 
   return planes;
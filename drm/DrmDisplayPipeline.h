@@ -17,6 +17,7 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 namespace android {
@@ -39,6 +40,7 @@ class PipelineBindable {
 
  public:
   auto *GetPipeline() {
+    const std::lock_guard<std::mutex> lock(binding_mutex_);
     return bound_pipeline_;
   }
 
@@ -47,8 +49,12 @@ class PipelineBindable {
       -> std::shared_ptr<BindingOwner<O>>;
 
  private:
-  DrmDisplayPipeline *bound_pipeline_;
+  DrmDisplayPipeline *bound_pipeline_{};
   std::weak_ptr<BindingOwner<O>> owner_object_;
+  /* The displays bind the objects concurrently, and a binding may be
+   * released by any thread, e.g. when a cleanup thread drops a frame.
+   */
+  std::mutex binding_mutex_;
 };
 
 template <class B>
@@ -56,7 +62,10 @@ class BindingOwner {
  public:
   explicit BindingOwner(B *pb) : bindable_(pb){};
   ~BindingOwner() {
-    bindable_->bound_pipeline_ = nullptr;
+    const std::lock_guard<std::mutex> lock(bindable_->binding_mutex_);
+    /* The object may have been bound again before the lock was taken */
+    if (bindable_->owner_object_.expired())
+      bindable_->bound_pipeline_ = nullptr;
   }
 
   B *Get() {
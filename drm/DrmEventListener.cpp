@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "drmhwc"
+
+#include "DrmEventListener.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <xf86drm.h>
+
+#include <cerrno>
+
+#include "drm/DrmDevice.h"
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmEventListener::CreateInstance(DrmDevice &dev)
+    -> std::unique_ptr<DrmEventListener> {
+  auto epoll_fd = MakeUniqueFd(epoll_create1(EPOLL_CLOEXEC));
+  auto stop_event_fd = MakeUniqueFd(eventfd(0, EFD_CLOEXEC));
+  if (!epoll_fd || !stop_event_fd) {
+    ALOGE("Failed to create the event listener fds: errno=%i", errno);
+    return {};
+  }
+
+  for (const int fd : {*dev.GetFd(), *stop_event_fd}) {
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(*epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      ALOGE("Failed to add fd=%i to epoll: errno=%i", fd, errno);
+      return {};
+    }
+  }
+
+  auto del = std::unique_ptr<DrmEventListener>(
+      new DrmEventListener(std::move(epoll_fd), std::move(stop_event_fd)));
+
+  del->drm_fd_ = dev.GetFd();
+  for (uint32_t i = 0; i < dev.GetCrtcs().size(); i++) {
+    del->clients_.emplace_back(
+        new Client{.listener = del.get(), .crtc_index = i});
+  }
+
+  del->thread_ = std::thread(&DrmEventListener::ThreadFn, del.get());
+
+  return del;
+}
+
+DrmEventListener::~DrmEventListener() {
+  const uint64_t value = 1;
+  if (write(*stop_event_fd_, &value, sizeof(value)) != sizeof(value)) {
+    ALOGE("Failed to stop the event listener: errno=%i", errno);
+  }
+
+  thread_.join();
+}
+
+void DrmEventListener::RegisterVBlankHandler(uint32_t crtc_index,
+                                             VBlankHandler handler) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  clients_.at(crtc_index)->handler = std::move(handler);
+}
+
+void DrmEventListener::UnregisterVBlankHandler(uint32_t crtc_index) {
+  std::unique_lock lock(mutex_);
+  auto &client = clients_.at(crtc_index);
+  client->handler = {};
+  handler_done_.wait(lock, [&client]() { return !client->running; });
+}
+
+auto DrmEventListener::RequestVBlankEvent(uint32_t crtc_index) -> int {
+  if (crtc_index >= clients_.size())
+    return -EINVAL;
+
+  auto &client = clients_[crtc_index];
+  if (client->pending.exchange(true))
+    return 0;
+
+  const uint32_t high_crtc = crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT;
+
+  drmVBlank vblank{};
+  vblank.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+                                           DRM_VBLANK_EVENT |
+                                           (high_crtc &
+                                            DRM_VBLANK_HIGH_CRTC_MASK));
+  vblank.request.sequence = 1;
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  vblank.request.signal = reinterpret_cast<uintptr_t>(client.get());
+
+  auto err = drmWaitVBlank(*drm_fd_, &vblank);
+  if (err != 0)
+    client->pending = false;
+
+  return err;
+}
+
+void DrmEventListener::HandleVBlankEvent(int /*fd*/, unsigned int sequence,
+                                         unsigned int tv_sec,
+                                         unsigned int tv_usec,
+                                         void *user_data) {
+  auto *client = static_cast<Client *>(user_data);
+
+  constexpr int64_t kOneSecondNs = 1LL * 1000 * 1000 * 1000;
+  constexpr int64_t kUsToNsMul = 1000;
+  const int64_t timestamp = int64_t(tv_sec) * kOneSecondNs +
+                            int64_t(tv_usec) * kUsToNsMul;
+
+  auto *listener = client->listener;
+  VBlankHandler handler;
+  {
+    const std::lock_guard<std::mutex> lock(listener->mutex_);
+    client->pending = false;
+    if (!client->handler)
+      return;
+
+    /* Called without the lock, the other CRTCs are not held up */
+    handler = client->handler;
+    client->running = true;
+  }
+
+  handler(timestamp, sequence);
+
+  {
+    const std::lock_guard<std::mutex> lock(listener->mutex_);
+    client->running = false;
+  }
+  listener->handler_done_.notify_all();
+}
+
+void DrmEventListener::ThreadFn() {
+  drmEventContext event_context = {
+      .version = 2,
+      .vblank_handler = &DrmEventListener::HandleVBlankEvent,
+  };
+
+  constexpr int kMaxEvents = 2;
+  struct epoll_event events[kMaxEvents];
+
+  for (;;) {
+    const int count = epoll_wait(*epoll_fd_, events, kMaxEvents, -1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+
+      ALOGE("epoll_wait failed: errno=%i", errno);
+      break;
+    }
+
+    bool stop = false;
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.fd == *stop_event_fd_) {
+        stop = true;
+      } else {
+        drmHandleEvent(*drm_fd_, &event_context);
+      }
+    }
+
+    if (stop)
+      break;
+  }
+
+  ALOGI("DrmEventListener thread exit");
+}
+
+}  // namespace android
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils/fd.h"
+
+namespace android {
+
+class DrmDevice;
+
+/* Reads the events of the DRM device on a single thread and dispatches them
+ * to the per-CRTC handlers.
+ */
+class DrmEventListener {
+ public:
+  using VBlankHandler = std::function<void(int64_t /*timestamp_ns*/,
+                                           uint32_t /*sequence*/)>;
+
+  static auto CreateInstance(DrmDevice &dev)
+      -> std::unique_ptr<DrmEventListener>;
+
+  ~DrmEventListener();
+  DrmEventListener(const DrmEventListener &) = delete;
+  DrmEventListener &operator=(const DrmEventListener &) = delete;
+
+  /* The handler is called from the listener thread. Unregistering waits for
+   * the running handler to return, so it must not be called from a handler.
+   */
+  void RegisterVBlankHandler(uint32_t crtc_index, VBlankHandler handler);
+  void UnregisterVBlankHandler(uint32_t crtc_index);
+
+  /* Queues a single event for the next vblank of the CRTC, does nothing if
+   * the event is already queued.
+   */
+  auto RequestVBlankEvent(uint32_t crtc_index) -> int;
+
+ private:
+  DrmEventListener(UniqueFd epoll_fd, UniqueFd stop_event_fd)
+      : epoll_fd_(std::move(epoll_fd)),
+        stop_event_fd_(std::move(stop_event_fd)){};
+
+  void ThreadFn();
+  static void HandleVBlankEvent(int fd, unsigned int sequence,
+                                unsigned int tv_sec, unsigned int tv_usec,
+                                void *user_data);
+
+  /* Passed as the event user data, never freed before the thread exits */
+  struct Client {
+    DrmEventListener *listener;
+    uint32_t crtc_index;
+    VBlankHandler handler;
+    std::atomic_bool pending{};
+    /* The handler is called without the lock, guarded by mutex_ */
+    bool running{};
+  };
+
+  SharedFd drm_fd_;
+  UniqueFd epoll_fd_;
+  UniqueFd stop_event_fd_;
+
+  /* Created once, the handlers are guarded by mutex_ */
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::mutex mutex_;
+  std::condition_variable handler_done_;
+
+  std::thread thread_;
+};
+
+}  // namespace android
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define LOG_TAG "drmhwc"
+
+#include "DrmFbImportWorker.h"
+
+#include <utils/Trace.h>
+
+#include "bufferinfo/BufferInfoGetter.h"
+#include "drm/DrmDevice.h"
+#include "utils/log.h"
+
+namespace android {
+
+auto DrmFbImportWorker::CreateInstance(DrmDevice &dev)
+    -> std::unique_ptr<DrmFbImportWorker> {
+  auto worker = std::unique_ptr<DrmFbImportWorker>(
+      new DrmFbImportWorker(dev));
+
+  worker->thread_ = std::thread(&DrmFbImportWorker::ThreadFn, worker.get());
+
+  return worker;
+}
+
+DrmFbImportWorker::~DrmFbImportWorker() {
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
+  }
+  cv_.notify_all();
+
+  thread_.join();
+
+  /* Don't leave the waiters with the broken promises */
+  for (auto &job : queue_)
+    job.result.set_value({});
+}
+
+auto DrmFbImportWorker::Enqueue(buffer_handle_t buffer)
+    -> std::future<FbImportResult> {
+  Job job{.buffer = buffer};
+  auto future = job.result.get_future();
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    queue_.emplace_back(std::move(job));
+  }
+  cv_.notify_all();
+
+  return future;
+}
+
+auto DrmFbImportWorker::Import(DrmDevice &dev, buffer_handle_t buffer)
+    -> FbImportResult {
+  FbImportResult res;
+
+  res.bi = BufferInfoGetter::GetInstance()->GetBoInfoCached(buffer);
+  if (!res.bi) {
+    ALOGW("Unable to get buffer information (0x%p)", buffer);
+    return res;
+  }
+
+  res.fb = dev.GetDrmFbImporter().GetOrCreateFbId(&res.bi.value());
+  if (!res.fb) {
+    ALOGV("Unable to create framebuffer object for buffer 0x%p", buffer);
+  }
+
+  return res;
+}
+
+void DrmFbImportWorker::ThreadFn() {
+  for (;;) {
+    Job job;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return exit_ || !queue_.empty(); });
+
+      if (exit_)
+        break;
+
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("AsyncImportFb");
+    job.result.set_value(Import(*drm_, job.buffer));
+  }
+}
+
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "bufferinfo/BufferInfo.h"
+#include "drm/DrmFbImporter.h"
+
+namespace android {
+
+class DrmDevice;
+
+struct FbImportResult {
+  std::optional<BufferInfo> bi;
+  std::shared_ptr<DrmFbIdHandle> fb;
+};
+
+/* Imports the buffers into the DRM device on a separate thread, so that the
+ * dmabuf import and the framebuffer registration are done before the buffer
+ * is needed for the composition.
+ */
+class DrmFbImportWorker {
+ public:
+  static auto CreateInstance(DrmDevice &dev)
+      -> std::unique_ptr<DrmFbImportWorker>;
+
+  ~DrmFbImportWorker();
+  DrmFbImportWorker(const DrmFbImportWorker &) = delete;
+  DrmFbImportWorker &operator=(const DrmFbImportWorker &) = delete;
+
+  /* The buffer handle must stay valid until the result is ready, also when
+   * the future is dropped: wait for it before releasing the handle.
+   */
+  auto Enqueue(buffer_handle_t buffer) -> std::future<FbImportResult>;
+
+  static auto Import(DrmDevice &dev, buffer_handle_t buffer) -> FbImportResult;
+
+ private:
+  explicit DrmFbImportWorker(DrmDevice &dev) : drm_(&dev){};
+
+  void ThreadFn();
+
+  struct Job {
+    buffer_handle_t buffer{};
+    std::promise<FbImportResult> result;
+  };
+
+  DrmDevice *const drm_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  bool exit_{};
+  std::thread thread_;
+};
+
+}  // namespace android
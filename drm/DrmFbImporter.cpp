@@ -26,6 +26,7 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <algorithm>
 #include <cinttypes>
 #include <system_error>
 
@@ -35,13 +36,15 @@
 namespace android {
 
 auto DrmFbIdHandle::CreateInstance(BufferInfo *bo, GemHandle first_gem_handle,
-                                   DrmDevice &drm)
+                                   DrmDevice &drm,
+                                   std::shared_ptr<std::recursive_mutex> lock)
     -> std::shared_ptr<DrmFbIdHandle> {
   // NOLINTNEXTLINE(misc-const-correctness)
   ATRACE_NAME("Import dmabufs and register FB");
 
   // NOLINTNEXTLINE(cppcoreguidelines-owning-memory): priv. constructor usage
-  std::shared_ptr<DrmFbIdHandle> local(new DrmFbIdHandle(drm));
+  std::shared_ptr<DrmFbIdHandle> local(
+      new DrmFbIdHandle(drm, std::move(lock)));
 
   local->gem_handles_[0] = first_gem_handle;
   int32_t err = 0;
@@ -96,6 +99,8 @@ DrmFbIdHandle::~DrmFbIdHandle() {
   // NOLINTNEXTLINE(misc-const-correctness)
   ATRACE_NAME("Close FB and dmabufs");
 
+  const std::lock_guard<std::recursive_mutex> lock(*lock_);
+
   /* Destroy framebuffer object */
   if (drmModeRmFB(*drm_fd_, fb_id_) != 0) {
     ALOGE("Failed to rm fb");
@@ -125,6 +130,28 @@ DrmFbIdHandle::~DrmFbIdHandle() {
   }
 }
 
+namespace {
+constexpr size_t kMinimalCleanupSize = 128;
+
+/* Memory, which is kept alive by the framebuffer */
+auto GetBufferBytes(const BufferInfo &bo) -> uint64_t {
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < kBufferMaxPlanes; i++) {
+    if (bo.prime_fds[i] > 0)
+      bytes += uint64_t(bo.pitches[i]) * bo.height;
+  }
+
+  return bytes;
+}
+}  // namespace
+
+DrmFbImporter::DrmFbImporter(DrmDevice &drm)
+    : drm_(&drm),
+      cleanup_threshold_(kMinimalCleanupSize),
+      lru_max_entries_(Properties::FbCacheMaxEntries()),
+      lru_max_bytes_(Properties::FbCacheMaxBytes()) {
+}
+
 auto DrmFbImporter::GetOrCreateFbId(BufferInfo *bo)
     -> std::shared_ptr<DrmFbIdHandle> {
   /* TODO: Clean up DrmDevices and DrmFbImporter inter-dependency.
@@ -135,6 +162,8 @@ auto DrmFbImporter::GetOrCreateFbId(BufferInfo *bo)
    * depend on each other. For now, just acquire the DRM fd from the DrmDevice
    * to make sure it is not closed.
    */
+  const std::lock_guard<std::recursive_mutex> lock(*lock_);
+
   if (drm_fd_ == nullptr) {
     drm_fd_ = drm_->GetFd();
   }
@@ -152,24 +181,79 @@ auto DrmFbImporter::GetOrCreateFbId(BufferInfo *bo)
 
   if (drm_fb_id_cached != drm_fb_id_handle_cache_.end()) {
     if (auto drm_fb_id_handle_shared = drm_fb_id_cached->second.lock()) {
+      stats_.hits++;
+      LruTouch(first_handle, drm_fb_id_handle_shared, GetBufferBytes(*bo));
       return drm_fb_id_handle_shared;
     }
     drm_fb_id_handle_cache_.erase(drm_fb_id_cached);
   }
 
+  stats_.misses++;
+
   /* Cleanup cached empty weak pointers */
-  const int minimal_cleanup_size = 128;
-  if (drm_fb_id_handle_cache_.size() > minimal_cleanup_size) {
+  if (drm_fb_id_handle_cache_.size() > cleanup_threshold_) {
     CleanupEmptyCacheElements();
   }
 
   /* No DrmFbIdHandle found in cache, create framebuffer object */
-  auto fb_id_handle = DrmFbIdHandle::CreateInstance(bo, first_handle, *drm_);
+  auto fb_id_handle = DrmFbIdHandle::CreateInstance(bo, first_handle, *drm_,
+                                                    lock_);
   if (fb_id_handle) {
     drm_fb_id_handle_cache_[first_handle] = fb_id_handle;
+    LruTouch(first_handle, fb_id_handle, GetBufferBytes(*bo));
   }
 
   return fb_id_handle;
 }
 
+void DrmFbImporter::CleanupEmptyCacheElements() {
+  for (auto it = drm_fb_id_handle_cache_.begin();
+       it != drm_fb_id_handle_cache_.end();) {
+    if (it->second.expired()) {
+      it = drm_fb_id_handle_cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  /* Don't rescan the cache on every import if most of the entries are alive */
+  cleanup_threshold_ = std::max(kMinimalCleanupSize,
+                                drm_fb_id_handle_cache_.size() * 2);
+}
+
+void DrmFbImporter::LruTouch(GemHandle handle,
+                             const std::shared_ptr<DrmFbIdHandle> &fb_id_handle,
+                             uint64_t bytes) {
+  if (lru_max_entries_ == 0 || lru_max_bytes_ == 0)
+    return;
+
+  auto it = lru_index_.find(handle);
+  if (it != lru_index_.end()) {
+    lru_bytes_ -= it->second->bytes;
+    lru_.erase(it->second);
+  }
+
+  lru_.push_front({handle, fb_id_handle, bytes});
+  lru_index_[handle] = lru_.begin();
+  lru_bytes_ += bytes;
+
+  while (!lru_.empty() &&
+         (lru_.size() > lru_max_entries_ || lru_bytes_ > lru_max_bytes_)) {
+    auto &last = lru_.back();
+    lru_bytes_ -= last.bytes;
+    lru_index_.erase(last.handle);
+    lru_.pop_back();
+    stats_.evictions++;
+  }
+}
+
+auto DrmFbImporter::GetStats() -> Stats {
+  const std::lock_guard<std::recursive_mutex> lock(*lock_);
+
+  Stats stats = stats_;
+  stats.lru_entries = lru_.size();
+  stats.lru_bytes = lru_bytes_;
+  return stats;
+}
+
 }  // namespace android
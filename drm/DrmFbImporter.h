@@ -20,7 +20,10 @@
 #include <hardware/gralloc.h>
 
 #include <array>
-#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "bufferinfo/BufferInfo.h"
 #include "drm/DrmDevice.h"
@@ -37,7 +40,9 @@ namespace android {
 class DrmFbIdHandle {
  public:
   static auto CreateInstance(BufferInfo *bo, GemHandle first_gem_handle,
-                             DrmDevice &drm) -> std::shared_ptr<DrmFbIdHandle>;
+                             DrmDevice &drm,
+                             std::shared_ptr<std::recursive_mutex> lock)
+      -> std::shared_ptr<DrmFbIdHandle>;
 
   ~DrmFbIdHandle();
   DrmFbIdHandle(DrmFbIdHandle &&) = delete;
@@ -50,9 +55,14 @@ class DrmFbIdHandle {
   }
 
  private:
-  explicit DrmFbIdHandle(DrmDevice &drm) : drm_fd_(drm.GetFd()) {};
+  DrmFbIdHandle(DrmDevice &drm, std::shared_ptr<std::recursive_mutex> lock)
+      : drm_fd_(drm.GetFd()), lock_(std::move(lock)) {};
 
   SharedFd drm_fd_;
+  /* GEM handles are shared with the handles being imported, see
+   * DrmFbImporter::lock_
+   */
+  std::shared_ptr<std::recursive_mutex> lock_;
 
   uint32_t fb_id_{};
   std::array<GemHandle, kBufferMaxPlanes> gem_handles_{};
@@ -60,7 +70,7 @@ class DrmFbIdHandle {
 
 class DrmFbImporter {
  public:
-  explicit DrmFbImporter(DrmDevice &drm) : drm_(&drm){};
+  explicit DrmFbImporter(DrmDevice &drm);
   ~DrmFbImporter() = default;
   DrmFbImporter(const DrmFbImporter &) = delete;
   DrmFbImporter(DrmFbImporter &&) = delete;
@@ -69,22 +79,51 @@ class DrmFbImporter {
 
   auto GetOrCreateFbId(BufferInfo *bo) -> std::shared_ptr<DrmFbIdHandle>;
 
+  struct Stats {
+    uint64_t hits{};
+    uint64_t misses{};
+    uint64_t evictions{};
+    size_t lru_entries{};
+    uint64_t lru_bytes{};
+  };
+
+  auto GetStats() -> Stats;
+
  private:
-  void CleanupEmptyCacheElements() {
-    for (auto it = drm_fb_id_handle_cache_.begin();
-         it != drm_fb_id_handle_cache_.end();) {
-      if (it->second.expired()) {
-        it = drm_fb_id_handle_cache_.erase(it);
-      } else {
-        ++it;
-      }
-    }
-  }
+  void CleanupEmptyCacheElements();
+  void LruTouch(GemHandle handle,
+                const std::shared_ptr<DrmFbIdHandle> &fb_id_handle,
+                uint64_t bytes);
 
   DrmDevice *const drm_;
   SharedFd drm_fd_;
 
-  std::map<GemHandle, std::weak_ptr<DrmFbIdHandle>> drm_fb_id_handle_cache_;
+  std::unordered_map<GemHandle, std::weak_ptr<DrmFbIdHandle>>
+      drm_fb_id_handle_cache_;
+  size_t cleanup_threshold_;
+
+  /* Strong references to the recently used framebuffers. Keeps them alive
+   * while their buffers are recycled, avoiding RmFB/AddFB2 churn.
+   */
+  struct LruEntry {
+    GemHandle handle;
+    std::shared_ptr<DrmFbIdHandle> fb_id_handle;
+    uint64_t bytes;
+  };
+  std::list<LruEntry> lru_;
+  std::unordered_map<GemHandle, std::list<LruEntry>::iterator> lru_index_;
+  uint64_t lru_bytes_{};
+  const uint32_t lru_max_entries_;
+  const uint64_t lru_max_bytes_;
+
+  Stats stats_;
+
+  /* Buffers are imported from several threads. drmPrimeFDToHandle() returns
+   * the GEM handle already owned by a DrmFbIdHandle for the same buffer, so
+   * the handle must not be closed while another import is in progress.
+   */
+  std::shared_ptr<std::recursive_mutex> lock_ =
+      std::make_shared<std::recursive_mutex>();
 };
 
 }  // namespace android
@@ -28,13 +28,48 @@ namespace android {
 
 DrmHwc::DrmHwc() : resource_manager_(this) {};
 
+auto DrmHwc::LockDisplay(hwc2_display_t display_handle) -> LockedDisplay {
+  LockedDisplay locked;
+  {
+    const std::lock_guard<std::mutex> lock(displays_mutex_);
+    auto it = displays_.find(display_handle);
+    if (it == displays_.end())
+      return locked;
+    locked.display = it->second;
+  }
+
+  locked.lock = std::unique_lock(locked.display->GetLock());
+  return locked;
+}
+
+void DrmHwc::InsertDisplay(hwc2_display_t display_handle,
+                           std::shared_ptr<HwcDisplay> display) {
+  const std::lock_guard<std::mutex> lock(displays_mutex_);
+  displays_[display_handle] = std::move(display);
+}
+
+void DrmHwc::EraseDisplay(hwc2_display_t display_handle) {
+  std::shared_ptr<HwcDisplay> display;
+  {
+    const std::lock_guard<std::mutex> lock(displays_mutex_);
+    auto it = displays_.find(display_handle);
+    if (it == displays_.end())
+      return;
+    display = std::move(it->second);
+    displays_.erase(it);
+  }
+  /* Destroyed here unless a composer call still holds it */
+}
+
 /* Must be called after every display attach/detach cycle */
 void DrmHwc::FinalizeDisplayBinding() {
   if (displays_.count(kPrimaryDisplay) == 0) {
     /* Primary display MUST always exist */
     ALOGI("No pipelines available. Creating null-display for headless mode");
-    displays_[kPrimaryDisplay] = std::make_unique<
-        HwcDisplay>(kPrimaryDisplay, HWC2::DisplayType::Physical, this);
+    InsertDisplay(kPrimaryDisplay,
+                  std::make_shared<HwcDisplay>(kPrimaryDisplay,
+                                               HWC2::DisplayType::Physical,
+                                               this));
     /* Initializes null-display */
     displays_[kPrimaryDisplay]->SetPipeline({});
   }
@@ -63,7 +98,7 @@ void DrmHwc::FinalizeDisplayBinding() {
   usleep(time_for_sf_to_dispose_display_us);
   mutex.lock();
   for (auto handle : displays_for_removal_list_) {
-    displays_.erase(handle);
+    EraseDisplay(handle);
   }
 }
 
@@ -82,9 +117,9 @@ bool DrmHwc::BindDisplay(std::shared_ptr<DrmDisplayPipeline> pipeline) {
   }
 
   if (displays_.count(disp_handle) == 0) {
-    auto disp = std::make_unique<HwcDisplay>(disp_handle,
+    auto disp = std::make_shared<HwcDisplay>(disp_handle,
                                              HWC2::DisplayType::Physical, this);
-    displays_[disp_handle] = std::move(disp);
+    InsertDisplay(disp_handle, std::move(disp));
   }
 
   ALOGI("Attaching pipeline '%s' to the display #%d%s",
@@ -116,8 +151,8 @@ bool DrmHwc::UnbindDisplay(std::shared_ptr<DrmDisplayPipeline> pipeline) {
   displays_[handle]->SetPipeline({});
 
   /* We must defer display disposal and removal, since it may still have pending
-   * HWC_API calls scheduled and waiting until ueventlistener thread releases
-   * main lock, otherwise transaction may fail and SF may crash
+   * HWC_API calls scheduled and waiting for the display lock, otherwise
+   * transaction may fail and SF may crash
    */
   if (handle != kPrimaryDisplay) {
     displays_for_removal_list_.emplace_back(handle);
@@ -146,12 +181,12 @@ HWC2::Error DrmHwc::CreateVirtualDisplay(
     return HWC2::Error::Unsupported;
 
   *display = ++last_display_handle_;
-  auto disp = std::make_unique<HwcDisplay>(*display, HWC2::DisplayType::Virtual,
+  auto disp = std::make_shared<HwcDisplay>(*display, HWC2::DisplayType::Virtual,
                                            this);
 
   disp->SetVirtualDisplayResolution(width, height);
   disp->SetPipeline(virtual_pipeline);
-  displays_[*display] = std::move(disp);
+  InsertDisplay(*display, std::move(disp));
   return HWC2::Error::None;
 }
 
@@ -173,7 +208,7 @@ HWC2::Error DrmHwc::DestroyVirtualDisplay(hwc2_display_t display) {
   usleep(time_for_sf_to_dispose_display_us);
   mutex.lock();
 
-  displays_.erase(display);
+  EraseDisplay(display);
 
   return HWC2::Error::None;
 }
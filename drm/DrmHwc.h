@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <mutex>
+
 #include "drm/DrmDisplayPipeline.h"
 #include "drm/ResourceManager.h"
 #include "hwc2_device/HwcDisplay.h"
@@ -51,12 +53,25 @@ class DrmHwc : public PipelineToFrontendBindingInterface {
   void Dump(uint32_t *out_size, char *out_buffer);
   uint32_t GetMaxVirtualDisplayCount();
 
-  auto GetDisplay(hwc2_display_t display_handle) {
-    return displays_.count(display_handle) != 0
-               ? displays_[display_handle].get()
-               : nullptr;
+  auto GetDisplay(hwc2_display_t display_handle) -> HwcDisplay * {
+    const std::lock_guard<std::mutex> lock(displays_mutex_);
+    auto it = displays_.find(display_handle);
+    return it != displays_.end() ? it->second.get() : nullptr;
   }
 
+  /* The display stays alive while referenced, even if it is unplugged
+   * meanwhile. The reference is declared first to outlive the lock.
+   */
+  struct LockedDisplay {
+    std::shared_ptr<HwcDisplay> display;
+    std::unique_lock<std::recursive_mutex> lock;
+  };
+
+  /* Locks a single display without blocking the others and the hotplug
+   * handling. Returns an empty display if the handle is unknown.
+   */
+  auto LockDisplay(hwc2_display_t display_handle) -> LockedDisplay;
+
   auto &GetResMan() {
     return resource_manager_;
   }
@@ -82,9 +97,19 @@ class DrmHwc : public PipelineToFrontendBindingInterface {
     return displays_;
   }
 
+  /* Removes the display from the list, the caller holds the device lock */
+  void EraseDisplay(hwc2_display_t display_handle);
+
  private:
+  void InsertDisplay(hwc2_display_t display_handle,
+                     std::shared_ptr<HwcDisplay> display);
+
   ResourceManager resource_manager_;
-  std::map<hwc2_display_t, std::unique_ptr<HwcDisplay>> displays_;
+  /* Modified with both the device lock and displays_mutex_ held, looked up
+   * with either one.
+   */
+  std::map<hwc2_display_t, std::shared_ptr<HwcDisplay>> displays_;
+  std::mutex displays_mutex_;
   std::map<std::shared_ptr<DrmDisplayPipeline>, hwc2_display_t>
       display_handles_;
 
@@ -22,6 +22,7 @@
 #include <cerrno>
 #include <cinttypes>
 #include <cstdint>
+#include <cstring>
 
 #include "DrmDevice.h"
 #include "bufferinfo/BufferInfoGetter.h"
@@ -49,7 +50,11 @@ auto DrmPlane::CreateInstance(DrmDevice &dev, uint32_t plane_id)
 
 int DrmPlane::Init() {
   // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-  formats_ = {plane_->formats, plane_->formats + plane_->count_formats};
+  caps_.formats = {plane_->formats, plane_->formats + plane_->count_formats};
+  caps_.has_non_rgb_format = std::any_of(
+      caps_.formats.begin(), caps_.formats.end(), [](uint32_t format) {
+        return !BufferInfoGetter::IsDrmFormatRgb(format);
+      });
 
   DrmProperty p;
 
@@ -86,8 +91,19 @@ int DrmPlane::Init() {
     return -ENOTSUP;
   }
 
+  SyncCommittedCrtcId();
+
   GetPlaneProperty("zpos", zpos_property_, Presence::kOptional);
 
+  if (GetPlaneProperty("IN_FORMATS", p, Presence::kOptional)) {
+    auto blob_id = p.GetValue();
+    if (!blob_id || !ParseInFormats(*blob_id)) {
+      ALOGW("Failed to parse IN_FORMATS of plane %d, ignoring modifiers",
+            GetId());
+      caps_.format_modifiers.clear();
+    }
+  }
+
   /* DRM/KMS uses counter-clockwise rotations, while HWC API uses
    * clockwise. That's why 90 and 270 are swapped here.
    */
@@ -145,15 +161,40 @@ int DrmPlane::Init() {
     }
   }
 
+  /* Without the rotation property only the identity transform is possible */
+  caps_.transforms = rotation_property_
+                         ? uint32_t(transform_enum_map_.GetPresenceMask())
+                         : 1U << LayerTransform::kIdentity;
+  caps_.has_alpha = bool(alpha_property_);
+  /* Planes without the blend property are expected to pre-multiply */
+  caps_.blend_modes = uint32_t(blending_enum_map_.GetPresenceMask()) |
+                      1U << uint32_t(BufferBlendMode::kNone) |
+                      1U << uint32_t(BufferBlendMode::kPreMult);
+
   return 0;
 }
 
-bool DrmPlane::IsCrtcSupported(const DrmCrtc &crtc) const {
-  auto crtc_prop_optval = crtc_property_.GetValue();
-  auto crtc_prop_val = crtc_prop_optval ? *crtc_prop_optval : 0;
+bool DrmPlane::IsCrtcSupported(const DrmCrtc &crtc) {
+  const bool possible = ((1 << crtc.GetIndexInResArray()) &
+                         plane_->possible_crtcs) != 0;
 
-  if (crtc_prop_val != 0 && crtc_prop_val != crtc.GetId() &&
-      GetType() == DRM_PLANE_TYPE_PRIMARY) {
+  if (GetType() != DRM_PLANE_TYPE_PRIMARY)
+    return possible;
+
+  /* Tracks the plane state set by the prior commits of any pipeline */
+  auto crtc_prop_val = committed_crtc_id_.load();
+  if (crtc_prop_val == kUnknownCrtcId) {
+    /* Unknown after ResetState(), the plane may still scan out for
+     * another CRTC. Only the CRTC owning the plane may use it.
+     */
+    auto *pipe = GetPipeline();
+    if (pipe != nullptr)
+      return pipe->crtc->Get() == &crtc && possible;
+
+    return plane_->possible_crtcs == (1U << crtc.GetIndexInResArray());
+  }
+
+  if (crtc_prop_val != 0 && crtc_prop_val != crtc.GetId()) {
     // Some DRM driver such as omap_drm allows sharing primary plane between
     // CRTCs, but the primary plane could not be shared if it has been used by
     // any CRTC already, which is protected by the plane_switching_crtc function
@@ -163,7 +204,7 @@ bool DrmPlane::IsCrtcSupported(const DrmCrtc &crtc) const {
     return false;
   }
 
-  return ((1 << crtc.GetIndexInResArray()) & plane_->possible_crtcs) != 0;
+  return possible;
 }
 
 bool DrmPlane::IsValidForLayer(LayerData *layer) {
@@ -172,26 +213,19 @@ bool DrmPlane::IsValidForLayer(LayerData *layer) {
     return false;
   }
 
-  if (!rotation_property_) {
-    if (layer->pi.transform != LayerTransform::kIdentity) {
-      ALOGV("No rotation property on plane %d", GetId());
-      return false;
-    }
-  } else {
-    if (transform_enum_map_.count(layer->pi.transform) == 0) {
-      ALOGV("Transform is not supported on plane %d", GetId());
-      return false;
-    }
+  const uint32_t transform = layer->pi.transform;
+  if (transform >= 32 || ((caps_.transforms >> transform) & 1U) == 0) {
+    ALOGV("Transform is not supported on plane %d", GetId());
+    return false;
   }
 
-  if (!alpha_property_ && layer->pi.alpha != UINT16_MAX) {
+  if (!caps_.has_alpha && layer->pi.alpha != UINT16_MAX) {
     ALOGV("Alpha is not supported on plane %d", GetId());
     return false;
   }
 
-  if (blending_enum_map_.count(layer->bi->blend_mode) == 0 &&
-      layer->bi->blend_mode != BufferBlendMode::kNone &&
-      layer->bi->blend_mode != BufferBlendMode::kPreMult) {
+  auto blend_mode = static_cast<uint32_t>(layer->bi->blend_mode);
+  if (blend_mode >= 32 || ((caps_.blend_modes >> blend_mode) & 1U) == 0) {
     ALOGV("Blending is not supported on plane %d", GetId());
     return false;
   }
@@ -203,19 +237,81 @@ bool DrmPlane::IsValidForLayer(LayerData *layer) {
     return false;
   }
 
+  auto modifier = layer->bi->modifiers[0];
+  if (!IsFormatModifierSupported(format, modifier)) {
+    ALOGV("Plane %d does not support modifier 0x%" PRIx64 " for %c%c%c%c",
+          GetId(), modifier, format, format >> 8, format >> 16, format >> 24);
+    return false;
+  }
+
   return true;
 }
 
-bool DrmPlane::IsFormatSupported(uint32_t format) const {
-  return std::find(std::begin(formats_), std::end(formats_), format) !=
-         std::end(formats_);
+bool DrmPlane::IsFormatModifierSupported(uint32_t format,
+                                         uint64_t modifier) const {
+  /* The framebuffer is created without modifiers, the driver picks the
+   * layout implicitly (see DrmFbImporter).
+   */
+  if (modifier == DRM_FORMAT_MOD_NONE || modifier == DRM_FORMAT_MOD_INVALID)
+    return true;
+
+  if (caps_.format_modifiers.empty())
+    return true;
+
+  auto it = caps_.format_modifiers.find(format);
+  if (it == caps_.format_modifiers.end())
+    return false;
+
+  return std::find(it->second.begin(), it->second.end(), modifier) !=
+         it->second.end();
 }
 
-bool DrmPlane::HasNonRgbFormat() const {
-  return std::find_if_not(std::begin(formats_), std::end(formats_),
-                          [](uint32_t format) {
-                            return BufferInfoGetter::IsDrmFormatRgb(format);
-                          }) != std::end(formats_);
+auto DrmPlane::ParseInFormats(uint64_t blob_id) -> bool {
+  auto blob = MakeDrmModePropertyBlobUnique(*drm_->GetFd(), blob_id);
+  if (!blob || blob->data == nullptr ||
+      blob->length < sizeof(drm_format_modifier_blob)) {
+    return false;
+  }
+
+  const auto *data = static_cast<const uint8_t *>(blob->data);
+  drm_format_modifier_blob header{};
+  memcpy(&header, data, sizeof(header));
+
+  const uint64_t formats_end = uint64_t(header.formats_offset) +
+                               uint64_t(header.count_formats) *
+                                   sizeof(uint32_t);
+  const uint64_t modifiers_end = uint64_t(header.modifiers_offset) +
+                                 uint64_t(header.count_modifiers) *
+                                     sizeof(drm_format_modifier);
+  if (formats_end > blob->length || modifiers_end > blob->length)
+    return false;
+
+  std::vector<uint32_t> formats(header.count_formats);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  memcpy(formats.data(), data + header.formats_offset,
+         formats.size() * sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < header.count_modifiers; i++) {
+    drm_format_modifier mod{};
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    memcpy(&mod, data + header.modifiers_offset + i * sizeof(mod),
+           sizeof(mod));
+
+    /* Every modifier covers up to 64 formats starting from the offset */
+    constexpr uint32_t kFormatsPerModifier = 64;
+    for (uint32_t bit = 0; bit < kFormatsPerModifier; bit++) {
+      if ((mod.formats & (uint64_t(1) << bit)) == 0)
+        continue;
+
+      const uint64_t idx = uint64_t(mod.offset) + bit;
+      if (idx >= formats.size())
+        break;
+
+      caps_.format_modifiers[formats[idx]].emplace_back(mod.modifier);
+    }
+  }
+
+  return true;
 }
 
 static uint64_t ToDrmRotation(LayerTransform transform) {
@@ -252,13 +348,17 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, LayerData &layer,
     return -EINVAL;
   }
 
+  /* Drop the values left by the prior not committed requests */
+  for (auto *prop : GetStateProperties())
+    prop->ClearPendingValue();
+
   if (zpos_property_ && !zpos_property_.IsImmutable()) {
     uint64_t min_zpos = 0;
 
     // Ignore ret and use min_zpos as 0 by default
     std::tie(std::ignore, min_zpos) = zpos_property_.RangeMin();
 
-    if (!zpos_property_.AtomicSet(pset, zpos + min_zpos)) {
+    if (!zpos_property_.AtomicSetIfChanged(pset, zpos + min_zpos)) {
       return -EINVAL;
     }
   }
@@ -268,45 +368,60 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, LayerData &layer,
     return -EINVAL;
   }
 
+  if (!crtc_property_.AtomicSetIfChanged(pset, crtc_id))
+    return -EINVAL;
+
+  /* The fence is attached to the framebuffer, keep them together */
+  const uint32_t fb_id = layer.fb->GetFbId();
+  if (layer.acquire_fence ? !fb_property_.AtomicSet(pset, fb_id)
+                          : !fb_property_.AtomicSetIfChanged(pset, fb_id)) {
+    return -EINVAL;
+  }
+
   auto &disp = layer.pi.display_frame;
   auto &src = layer.pi.source_crop;
-  if (!crtc_property_.AtomicSet(pset, crtc_id) ||
-      !fb_property_.AtomicSet(pset, layer.fb->GetFbId()) ||
-      !crtc_x_property_.AtomicSet(pset, disp.left) ||
-      !crtc_y_property_.AtomicSet(pset, disp.top) ||
-      !crtc_w_property_.AtomicSet(pset, disp.right - disp.left) ||
-      !crtc_h_property_.AtomicSet(pset, disp.bottom - disp.top) ||
-      !src_x_property_.AtomicSet(pset, To1616FixPt(src.left)) ||
-      !src_y_property_.AtomicSet(pset, To1616FixPt(src.top)) ||
-      !src_w_property_.AtomicSet(pset, To1616FixPt(src.right - src.left)) ||
-      !src_h_property_.AtomicSet(pset, To1616FixPt(src.bottom - src.top))) {
+  if (!crtc_x_property_.AtomicSetIfChanged(pset, disp.left) ||
+      !crtc_y_property_.AtomicSetIfChanged(pset, disp.top) ||
+      !crtc_w_property_.AtomicSetIfChanged(pset, disp.right - disp.left) ||
+      !crtc_h_property_.AtomicSetIfChanged(pset, disp.bottom - disp.top) ||
+      !src_x_property_.AtomicSetIfChanged(pset, To1616FixPt(src.left)) ||
+      !src_y_property_.AtomicSetIfChanged(pset, To1616FixPt(src.top)) ||
+      !src_w_property_.AtomicSetIfChanged(pset,
+                                          To1616FixPt(src.right - src.left)) ||
+      !src_h_property_.AtomicSetIfChanged(pset,
+                                          To1616FixPt(src.bottom - src.top))) {
     return -EINVAL;
   }
 
   if (rotation_property_ &&
-      !rotation_property_.AtomicSet(pset, ToDrmRotation(layer.pi.transform))) {
+      !rotation_property_
+           .AtomicSetIfChanged(pset, ToDrmRotation(layer.pi.transform))) {
     return -EINVAL;
   }
 
-  if (alpha_property_ && !alpha_property_.AtomicSet(pset, layer.pi.alpha)) {
+  if (alpha_property_ &&
+      !alpha_property_.AtomicSetIfChanged(pset, layer.pi.alpha)) {
     return -EINVAL;
   }
 
-  if (blending_enum_map_.count(layer.bi->blend_mode) != 0 &&
-      !blend_property_.AtomicSet(pset,
-                                 blending_enum_map_[layer.bi->blend_mode])) {
+  if (blending_enum_map_.Contains(layer.bi->blend_mode) &&
+      !blend_property_
+           .AtomicSetIfChanged(pset,
+                               blending_enum_map_.Get(layer.bi->blend_mode))) {
     return -EINVAL;
   }
 
-  if (color_encoding_enum_map_.count(layer.bi->color_space) != 0 &&
+  if (color_encoding_enum_map_.Contains(layer.bi->color_space) &&
       !color_encoding_propery_
-           .AtomicSet(pset, color_encoding_enum_map_[layer.bi->color_space])) {
+           .AtomicSetIfChanged(pset, color_encoding_enum_map_.Get(
+                                         layer.bi->color_space))) {
     return -EINVAL;
   }
 
-  if (color_range_enum_map_.count(layer.bi->sample_range) != 0 &&
+  if (color_range_enum_map_.Contains(layer.bi->sample_range) &&
       !color_range_property_
-           .AtomicSet(pset, color_range_enum_map_[layer.bi->sample_range])) {
+           .AtomicSetIfChanged(pset, color_range_enum_map_.Get(
+                                         layer.bi->sample_range))) {
     return -EINVAL;
   }
 
@@ -314,6 +429,9 @@ auto DrmPlane::AtomicSetState(drmModeAtomicReq &pset, LayerData &layer,
 }
 
 auto DrmPlane::AtomicDisablePlane(drmModeAtomicReq &pset) -> int {
+  for (auto *prop : GetStateProperties())
+    prop->ClearPendingValue();
+
   if (!crtc_property_.AtomicSet(pset, 0) || !fb_property_.AtomicSet(pset, 0)) {
     return -EINVAL;
   }
@@ -321,6 +439,37 @@ auto DrmPlane::AtomicDisablePlane(drmModeAtomicReq &pset) -> int {
   return 0;
 }
 
+auto DrmPlane::GetStateProperties()
+    -> std::array<DrmProperty *, kStatePropertiesCount> {
+  return {&crtc_property_,          &fb_property_,
+          &crtc_x_property_,        &crtc_y_property_,
+          &crtc_w_property_,        &crtc_h_property_,
+          &src_x_property_,         &src_y_property_,
+          &src_w_property_,         &src_h_property_,
+          &zpos_property_,          &rotation_property_,
+          &alpha_property_,         &blend_property_,
+          &color_encoding_propery_, &color_range_property_};
+}
+
+void DrmPlane::CommitState() {
+  for (auto *prop : GetStateProperties())
+    prop->CommitPendingValue();
+
+  SyncCommittedCrtcId();
+}
+
+void DrmPlane::ResetState() {
+  for (auto *prop : GetStateProperties())
+    prop->InvalidateCommittedValue();
+
+  SyncCommittedCrtcId();
+}
+
+void DrmPlane::SyncCommittedCrtcId() {
+  committed_crtc_id_ = crtc_property_.GetCommittedValue().value_or(
+      kUnknownCrtcId);
+}
+
 auto DrmPlane::GetPlaneProperty(const char *prop_name, DrmProperty &property,
                                 Presence presence) -> bool {
   auto err = drm_->GetProperty(GetId(), DRM_MODE_OBJECT_PLANE, prop_name,
@@ -18,8 +18,11 @@
 
 #include <xf86drmMode.h>
 
+#include <array>
+#include <atomic>
 #include <cstdint>
-#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "DrmCrtc.h"
 #include "DrmProperty.h"
@@ -38,19 +41,56 @@ class DrmPlane : public PipelineBindable<DrmPlane> {
   static auto CreateInstance(DrmDevice &dev, uint32_t plane_id)
       -> std::unique_ptr<DrmPlane>;
 
-  bool IsCrtcSupported(const DrmCrtc &crtc) const;
+  bool IsCrtcSupported(const DrmCrtc &crtc);
   bool IsValidForLayer(LayerData *layer);
 
   auto GetType() const {
     return type_;
   }
 
-  bool IsFormatSupported(uint32_t format) const;
-  bool HasNonRgbFormat() const;
+  /* Capabilities of the plane, computed once by Init(). Checking a layer
+   * against them takes a few bit tests and a hash lookup.
+   */
+  struct Capabilities {
+    std::unordered_set<uint32_t> formats;
+    /* Modifiers of every format, parsed from the IN_FORMATS blob. Empty if
+     * the plane doesn't expose the property.
+     */
+    std::unordered_map<uint32_t, std::vector<uint64_t>> format_modifiers;
+    bool has_non_rgb_format{};
+    bool has_alpha{};
+    /* Bit N is set if the LayerTransform with value N is supported */
+    uint32_t transforms{};
+    /* Bit N is set if the BufferBlendMode with value N is supported */
+    uint32_t blend_modes{};
+  };
+
+  auto &GetCapabilities() const {
+    return caps_;
+  }
+
+  bool IsFormatSupported(uint32_t format) const {
+    return caps_.formats.count(format) != 0;
+  }
+
+  bool HasNonRgbFormat() const {
+    return caps_.has_non_rgb_format;
+  }
+
+  bool IsFormatModifierSupported(uint32_t format, uint64_t modifier) const;
 
   auto AtomicSetState(drmModeAtomicReq &pset, LayerData &layer, uint32_t zpos,
                       uint32_t crtc_id) -> int;
   auto AtomicDisablePlane(drmModeAtomicReq &pset) -> int;
+
+  /* Must be called once the request built by AtomicSetState() or
+   * AtomicDisablePlane() is committed successfully.
+   */
+  void CommitState();
+
+  /* Forces the next request to contain every plane property */
+  void ResetState();
+
   auto &GetZPosProperty() const {
     return zpos_property_;
   }
@@ -70,10 +110,24 @@ class DrmPlane : public PipelineBindable<DrmPlane> {
   auto Init() -> int;
   auto GetPlaneProperty(const char *prop_name, DrmProperty &property,
                         Presence presence = Presence::kMandatory) -> bool;
+  auto ParseInFormats(uint64_t blob_id) -> bool;
+
+  /* Properties, which values are shadowed between the requests */
+  static constexpr size_t kStatePropertiesCount = 16;
+  auto GetStateProperties()
+      -> std::array<DrmProperty *, kStatePropertiesCount>;
+
+  /* Mirrors the committed value of crtc_property_. The properties are only
+   * touched by the display committing to the pipeline the plane is used by,
+   * while IsCrtcSupported() is called from any display.
+   */
+  static constexpr uint64_t kUnknownCrtcId = UINT64_MAX;
+  void SyncCommittedCrtcId();
+  std::atomic<uint64_t> committed_crtc_id_{kUnknownCrtcId};
 
   uint32_t type_{};
 
-  std::vector<uint32_t> formats_;
+  Capabilities caps_;
 
   DrmProperty crtc_property_;
   DrmProperty fb_property_;
@@ -93,9 +147,10 @@ class DrmPlane : public PipelineBindable<DrmPlane> {
   DrmProperty color_encoding_propery_;
   DrmProperty color_range_property_;
 
-  std::map<BufferBlendMode, uint64_t> blending_enum_map_;
-  std::map<BufferColorSpace, uint64_t> color_encoding_enum_map_;
-  std::map<BufferSampleRange, uint64_t> color_range_enum_map_;
-  std::map<LayerTransform, uint64_t> transform_enum_map_;
+  /* Sized to hold every value of the enum */
+  DrmEnumTable<BufferBlendMode, 4> blending_enum_map_;
+  DrmEnumTable<BufferColorSpace, 4> color_encoding_enum_map_;
+  DrmEnumTable<BufferSampleRange, 3> color_range_enum_map_;
+  DrmEnumTable<LayerTransform, 32> transform_enum_map_;
 };
 }  // namespace android
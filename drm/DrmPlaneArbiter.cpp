@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "drmhwc"
+
+#include "DrmPlaneArbiter.h"
+
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "drm/DrmConnector.h"
+#include "drm/DrmCrtc.h"
+#include "drm/DrmDevice.h"
+#include "drm/DrmPlane.h"
+#include "utils/log.h"
+
+namespace android {
+
+namespace {
+
+auto PriorityName(DrmPlaneArbiter::Priority priority) -> const char * {
+  switch (priority) {
+    case DrmPlaneArbiter::Priority::kExternalUi:
+      return "external UI";
+    case DrmPlaneArbiter::Priority::kInternalUi:
+      return "internal UI";
+    case DrmPlaneArbiter::Priority::kExternalVideo:
+      return "external video";
+    case DrmPlaneArbiter::Priority::kInternalVideo:
+      return "internal video";
+  }
+  return "unknown";
+}
+
+auto PipelineName(DrmDisplayPipeline *pipe) -> std::string {
+  return pipe->connector->Get()->GetName();
+}
+
+}  // namespace
+
+void DrmPlaneArbiter::RegisterPipeline(DrmDisplayPipeline *pipe,
+                                       Client client) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  auto internal = pipe->connector->Get()->IsInternal();
+  pipelines_[pipe] = {
+      .reg = std::make_shared<Registration>(
+          Registration{.client = std::move(client)}),
+      .priority = internal ? Priority::kInternalUi : Priority::kExternalUi,
+  };
+}
+
+void DrmPlaneArbiter::UnregisterPipeline(DrmDisplayPipeline *pipe) {
+  std::unique_lock lock(mutex_);
+  auto it = pipelines_.find(pipe);
+  if (it == pipelines_.end())
+    return;
+
+  auto reg = it->second.reg;
+  pipelines_.erase(it);
+  CancelRequests(pipe);
+
+  /* The client may be destroyed once this returns */
+  callbacks_done_.wait(lock, [&reg]() { return reg->in_flight == 0; });
+}
+
+void DrmPlaneArbiter::CancelRequests(DrmDisplayPipeline *pipe) {
+  for (auto it = handovers_.begin(); it != handovers_.end();) {
+    if (it->second == pipe) {
+      it = handovers_.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+void DrmPlaneArbiter::SetPriority(DrmDisplayPipeline *pipe, bool has_video) {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  auto it = pipelines_.find(pipe);
+  if (it == pipelines_.end())
+    return;
+
+  auto internal = pipe->connector->Get()->IsInternal();
+  if (has_video) {
+    it->second.priority = internal ? Priority::kInternalVideo
+                                   : Priority::kExternalVideo;
+  } else {
+    it->second.priority = internal ? Priority::kInternalUi
+                                   : Priority::kExternalUi;
+  }
+}
+
+auto DrmPlaneArbiter::IsUsableOverlay(DrmPlane &plane, DrmDisplayPipeline &pipe)
+    -> bool {
+  return plane.GetType() == DRM_PLANE_TYPE_OVERLAY &&
+         plane.IsCrtcSupported(*pipe.crtc->Get());
+}
+
+auto DrmPlaneArbiter::LeaseOverlays(DrmDisplayPipeline &pipe)
+    -> std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> {
+  std::vector<std::shared_ptr<BindingOwner<DrmPlane>>> planes;
+  const std::lock_guard<std::mutex> lock(mutex_);
+
+  for (const auto &plane : drm_->GetPlanes()) {
+    if (!IsUsableOverlay(*plane, pipe))
+      continue;
+
+    /* Withheld from the current holder as well */
+    auto handover = handovers_.find(plane.get());
+    if (handover != handovers_.end() && handover->second != &pipe)
+      continue;
+
+    auto op = plane->BindPipeline(&pipe, true);
+    if (!op)
+      continue;
+
+    if (handover != handovers_.end()) {
+      ALOGV("Plane %u handed over to %s", plane->GetId(),
+            PipelineName(&pipe).c_str());
+      handovers_.erase(handover);
+    }
+
+    planes.emplace_back(op);
+  }
+
+  return planes;
+}
+
+bool DrmPlaneArbiter::RequestPlanes(DrmDisplayPipeline *pipe, size_t count) {
+  std::unique_lock lock(mutex_);
+  if (count == 0) {
+    CancelRequests(pipe);
+    return false;
+  }
+
+  size_t pending = 0;
+  for (auto &[plane, next_owner] : handovers_)
+    pending += next_owner == pipe ? 1 : 0;
+
+  auto self = pipelines_.find(pipe);
+  auto priority = self != pipelines_.end() ? self->second.priority
+                                           : Priority::kExternalUi;
+
+  bool bound_elsewhere = false;
+  std::set<DrmDisplayPipeline *> to_replan;
+  std::set<DrmDisplayPipeline *> asked;
+  /* The callbacks are invoked once the lock is released */
+  std::vector<std::shared_ptr<Registration>> replans;
+  std::vector<std::pair<std::string, std::shared_ptr<Registration>>> releases;
+
+  for (const auto &plane : drm_->GetPlanes()) {
+    if (!IsUsableOverlay(*plane, *pipe))
+      continue;
+
+    auto *holder = plane->GetPipeline();
+    if (holder == nullptr || holder == pipe)
+      continue;
+
+    bound_elsewhere = true;
+    if (handovers_.count(plane.get()) != 0)
+      continue;
+
+    auto it = pipelines_.find(holder);
+    if (it == pipelines_.end())
+      continue;
+
+    if (pending < count && it->second.priority < priority) {
+      handovers_[plane.get()] = pipe;
+      pending++;
+      to_replan.emplace(holder);
+      continue;
+    }
+
+    if (asked.emplace(holder).second) {
+      it->second.reg->in_flight++;
+      releases.emplace_back(PipelineName(holder), it->second.reg);
+    }
+  }
+
+  for (auto *holder : to_replan) {
+    auto &reg = pipelines_[holder].reg;
+    reg->in_flight++;
+    replans.emplace_back(reg);
+  }
+
+  if (releases.empty() && replans.empty())
+    return bound_elsewhere;
+
+  lock.unlock();
+
+  for (auto &[name, reg] : releases) {
+    if (reg->client.release_if_idle())
+      ALOGV("Idle %s asked to release its overlays", name.c_str());
+  }
+
+  for (auto &reg : replans)
+    reg->client.replan();
+
+  lock.lock();
+  for (auto &[name, reg] : releases)
+    reg->in_flight--;
+  for (auto &reg : replans)
+    reg->in_flight--;
+  callbacks_done_.notify_all();
+
+  return bound_elsewhere;
+}
+
+auto DrmPlaneArbiter::Dump() -> std::string {
+  std::stringstream ss;
+  ss << "Overlay planes (shared by the displays of the device):\n";
+  const std::lock_guard<std::mutex> lock(mutex_);
+
+  for (const auto &plane : drm_->GetPlanes()) {
+    if (plane->GetType() != DRM_PLANE_TYPE_OVERLAY)
+      continue;
+
+    ss << " Plane " << plane->GetId() << ": ";
+    auto *holder = plane->GetPipeline();
+    if (holder == nullptr) {
+      ss << "free";
+    } else {
+      ss << PipelineName(holder);
+      auto it = pipelines_.find(holder);
+      if (it != pipelines_.end())
+        ss << " (" << PriorityName(it->second.priority) << ")";
+    }
+
+    auto handover = handovers_.find(plane.get());
+    if (handover != handovers_.end())
+      ss << " -> " << PipelineName(handover->second);
+
+    ss << "\n";
+  }
+
+  return ss.str();
+}
+
+}  // namespace android
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "drm/DrmDisplayPipeline.h"
+
+namespace android {
+
+class DrmDevice;
+class DrmPlane;
+
+/* Leases the overlay planes of a DRM device to its display pipelines.
+ *
+ * A plane stays bound to a pipeline while the frames of the pipeline use it.
+ * A pipeline which could scan out more layers requests planes: the ones held
+ * by lower priority pipelines are handed over, the idle holders of the others
+ * are asked to flatten. A handed over plane is withheld from the holder, so
+ * the binding ends once its next frame replaces the previous one on the
+ * screen, and only the requester can take the plane afterwards.
+ *
+ * The displays are composed concurrently, the client callbacks are invoked
+ * after the arbiter lock is released, from the thread requesting planes.
+ * UnregisterPipeline() returns once no callback of the client is running.
+ */
+class DrmPlaneArbiter {
+ public:
+  /* Video layers rank above UI, internal displays above external ones */
+  enum class Priority : uint32_t {
+    kExternalUi,
+    kInternalUi,
+    kExternalVideo,
+    kInternalVideo,
+  };
+
+  struct Client {
+    /* Composes a new frame with the planes left to the display */
+    std::function<void()> replan;
+    /* Flattens the display if it is idle, returns false otherwise */
+    std::function<bool()> release_if_idle;
+  };
+
+  explicit DrmPlaneArbiter(DrmDevice &dev) : drm_(&dev){};
+
+  void RegisterPipeline(DrmDisplayPipeline *pipe, Client client);
+  void UnregisterPipeline(DrmDisplayPipeline *pipe);
+
+  void SetPriority(DrmDisplayPipeline *pipe, bool has_video);
+
+  /* Binds the overlays the pipeline may use for its next frame */
+  auto LeaseOverlays(DrmDisplayPipeline &pipe)
+      -> std::vector<std::shared_ptr<BindingOwner<DrmPlane>>>;
+
+  /* |pipe| could scan out |count| more layers, zero cancels its pending
+   * requests. Returns true if any overlay it can use is bound elsewhere.
+   */
+  bool RequestPlanes(DrmDisplayPipeline *pipe, size_t count);
+
+  auto Dump() -> std::string;
+
+ private:
+  struct Registration {
+    Client client;
+    /* Callbacks running without the lock, guarded by mutex_ */
+    size_t in_flight{};
+  };
+
+  struct Entry {
+    std::shared_ptr<Registration> reg;
+    Priority priority{};
+  };
+
+  auto IsUsableOverlay(DrmPlane &plane, DrmDisplayPipeline &pipe) -> bool;
+  void CancelRequests(DrmDisplayPipeline *pipe);
+
+  DrmDevice *const drm_;
+
+  std::mutex mutex_;
+  std::condition_variable callbacks_done_;
+
+  std::map<DrmDisplayPipeline *, Entry> pipelines_;
+  /* Planes being handed over, mapped to their next owner */
+  std::map<DrmPlane *, DrmDisplayPipeline *> handovers_;
+};
+
+}  // namespace android
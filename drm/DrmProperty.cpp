@@ -46,6 +46,8 @@ void DrmProperty::Init(uint32_t obj_id, drmModePropertyPtr p, uint64_t value) {
   flags_ = p->flags;
   name_ = p->name;
   value_ = value;
+  committed_value_ = value;
+  pending_value_.reset();
 
   for (int i = 0; i < p->count_values; ++i)
     // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic):
@@ -112,7 +114,7 @@ std::tuple<uint64_t, int> DrmProperty::GetEnumValueWithName(
   return std::make_tuple(UINT64_MAX, -EINVAL);
 }
 
-auto DrmProperty::AtomicSet(drmModeAtomicReq &pset, uint64_t value) const
+auto DrmProperty::AtomicSet(drmModeAtomicReq &pset, uint64_t value)
     -> bool {
   if (id_ == 0) {
     ALOGE("AtomicSet() is called on non-initialized property!");
@@ -123,9 +125,20 @@ auto DrmProperty::AtomicSet(drmModeAtomicReq &pset, uint64_t value) const
           name_.c_str());
     return false;
   }
+  pending_value_ = value;
   return true;
 }
 
+auto DrmProperty::AtomicSetIfChanged(drmModeAtomicReq &pset,
+                                     uint64_t value) -> bool {
+  if (id_ != 0 && !IsChangedBy(value)) {
+    pending_value_ = value;
+    return true;
+  }
+
+  return AtomicSet(pset, value);
+}
+
 std::optional<std::string> DrmProperty::GetEnumNameFromValue(
     uint64_t value) const {
   if (enums_.empty()) {
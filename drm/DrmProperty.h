@@ -18,6 +18,7 @@
 
 #include <xf86drmMode.h>
 
+#include <array>
 #include <cstdint>
 #include <map>
 #include <optional>
@@ -26,6 +27,44 @@
 
 namespace android {
 
+/* Maps the values of a small dense enum to the values of a DRM enum property.
+ * Lookups are a bounds check, a bit test and an array access.
+ */
+template <class E, size_t kSize>
+class DrmEnumTable {
+ public:
+  static_assert(kSize <= 64, "Presence mask is limited to 64 entries");
+
+  auto Contains(E key) const -> bool {
+    auto idx = static_cast<uint64_t>(key);
+    return idx < kSize && (present_ & (uint64_t(1) << idx)) != 0;
+  }
+
+  /* Must be called only for the keys, for which Contains() is true */
+  auto Get(E key) const -> uint64_t {
+    return values_[static_cast<size_t>(key)];
+  }
+
+  /* Bit N is set if the key with value N is present */
+  auto GetPresenceMask() const -> uint64_t {
+    return present_;
+  }
+
+  auto Set(E key, uint64_t value) -> bool {
+    auto idx = static_cast<uint64_t>(key);
+    if (idx >= kSize)
+      return false;
+
+    values_[idx] = value;
+    present_ |= uint64_t(1) << idx;
+    return true;
+  }
+
+ private:
+  std::array<uint64_t, kSize> values_{};
+  uint64_t present_{};
+};
+
 class DrmProperty {
  public:
   DrmProperty() = default;
@@ -57,13 +96,54 @@ class DrmProperty {
   auto RangeMin() const -> std::tuple<int, uint64_t>;
   auto RangeMax() const -> std::tuple<int, uint64_t>;
 
-  [[nodiscard]] auto AtomicSet(drmModeAtomicReq &pset, uint64_t value) const
+  /* Adds the property to the request. The value becomes pending until
+   * CommitPendingValue() is called once the request is committed.
+   */
+  [[nodiscard]] auto AtomicSet(drmModeAtomicReq &pset, uint64_t value)
       -> bool;
 
+  /* Same as AtomicSet(), but the property is not added to the request if
+   * the value is already committed.
+   */
+  [[nodiscard]] auto AtomicSetIfChanged(drmModeAtomicReq &pset,
+                                        uint64_t value) -> bool;
+
+  /* Returns true if committing the value would change the property state */
+  auto IsChangedBy(uint64_t value) const -> bool {
+    return !committed_value_ || *committed_value_ != value;
+  }
+
+  /* Last value committed to the kernel, initially the value read at
+   * enumeration. Empty if the state of the property is unknown.
+   */
+  auto GetCommittedValue() const -> std::optional<uint64_t> {
+    return committed_value_;
+  }
+
+  void ClearPendingValue() {
+    pending_value_.reset();
+  }
+
+  void CommitPendingValue() {
+    if (pending_value_)
+      committed_value_ = pending_value_;
+
+    pending_value_.reset();
+  }
+
+  void InvalidateCommittedValue() {
+    committed_value_.reset();
+    pending_value_.reset();
+  }
+
   template <class E>
   auto AddEnumToMap(const std::string &name, E key, std::map<E, uint64_t> &map)
       -> bool;
 
+  template <class E, size_t kSize>
+  auto AddEnumToMap(const std::string &name, E key,
+                    DrmEnumTable<E, kSize> &table) -> bool;
+
   template <class E>
   auto AddEnumToMapReverse(const std::string &name, E value,
                            std::map<uint64_t, E> &map) -> bool;
@@ -91,6 +171,10 @@ class DrmProperty {
   std::string name_;
   uint64_t value_ = 0;
 
+  /* Shadow of the kernel state, see AtomicSet() */
+  std::optional<uint64_t> committed_value_;
+  std::optional<uint64_t> pending_value_;
+
   std::vector<uint64_t> values_;
   std::vector<DrmPropertyEnum> enums_;
   std::vector<uint32_t> blob_ids_;
@@ -110,6 +194,19 @@ auto DrmProperty::AddEnumToMap(const std::string &name, E key,
   return false;
 }
 
+template <class E, size_t kSize>
+auto DrmProperty::AddEnumToMap(const std::string &name, E key,
+                               DrmEnumTable<E, kSize> &table) -> bool {
+  uint64_t enum_value = UINT64_MAX;
+  int err = 0;
+  std::tie(enum_value, err) = GetEnumValueWithName(name);
+  if (err == 0) {
+    return table.Set(key, enum_value);
+  }
+
+  return false;
+}
+
 template <class E>
 auto DrmProperty::AddEnumToMapReverse(const std::string &name, E value,
                                       std::map<uint64_t, E> &map) -> bool {
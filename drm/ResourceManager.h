@@ -21,7 +21,10 @@
 
 #include "DrmDevice.h"
 #include "DrmDisplayPipeline.h"
+#include "DrmEventListener.h"
+#include "DrmFbImportWorker.h"
 #include "DrmFbImporter.h"
+#include "DrmPlaneArbiter.h"
 #include "DrmProperty.h"
 #include "UEventListener.h"
 
@@ -86,6 +89,10 @@ class ResourceManager {
 
   std::shared_ptr<UEventListener> uevent_listener_;
 
+  /* Device lock: serializes the hotplug handling and the changes of the
+   * display list. The composer calls on a display take the display lock
+   * instead, see DrmHwc::LockDisplay().
+   */
   std::recursive_mutex main_lock_;
 
   std::map<DrmConnector *, std::shared_ptr<DrmDisplayPipeline>>
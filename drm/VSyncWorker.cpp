@@ -18,9 +18,8 @@
 
 #include "VSyncWorker.h"
 
-#include <xf86drm.h>
-#include <xf86drmMode.h>
-
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
@@ -35,12 +34,17 @@ auto VSyncWorker::CreateInstance(std::shared_ptr<DrmDisplayPipeline> &pipe)
   auto vsw = std::unique_ptr<VSyncWorker>(new VSyncWorker());
 
   if (pipe) {
-    vsw->high_crtc_ = pipe->crtc->Get()->GetIndexInResArray()
-                      << DRM_VBLANK_HIGH_CRTC_SHIFT;
-    vsw->drm_fd_ = pipe->device->GetFd();
+    vsw->crtc_index_ = pipe->crtc->Get()->GetIndexInResArray();
+    vsw->event_listener_ = pipe->device->GetEventListener();
   }
 
-  vsw->vswt_ = std::thread(&VSyncWorker::ThreadFn, vsw.get());
+  if (vsw->event_listener_ != nullptr) {
+    vsw->event_listener_->RegisterVBlankHandler(
+        vsw->crtc_index_,
+        [vsw = vsw.get()](int64_t timestamp, uint32_t /*sequence*/) {
+          vsw->OnVBlankEvent(timestamp);
+        });
+  }
 
   return vsw;
 }
@@ -48,7 +52,11 @@ auto VSyncWorker::CreateInstance(std::shared_ptr<DrmDisplayPipeline> &pipe)
 VSyncWorker::~VSyncWorker() {
   StopThread();
 
-  vswt_.join();
+  if (event_listener_ != nullptr)
+    event_listener_->UnregisterVBlankHandler(crtc_index_);
+
+  if (vswt_.joinable())
+    vswt_.join();
 }
 
 void VSyncWorker::UpdateVSyncControl() {
@@ -56,14 +64,33 @@ void VSyncWorker::UpdateVSyncControl() {
     const std::lock_guard<std::mutex> lock(mutex_);
     enabled_ = ShouldEnable();
     last_timestamp_ = -1;
+
+    if (enabled_ && !ArmVBlankEvent())
+      StartSyntheticThread();
   }
 
   cv_.notify_all();
 }
 
+bool VSyncWorker::ArmVBlankEvent() {
+  if (event_listener_ == nullptr || thread_exit_)
+    return false;
+
+  if (!vblank_armed_)
+    vblank_armed_ = event_listener_->RequestVBlankEvent(crtc_index_) == 0;
+
+  return vblank_armed_;
+}
+
+void VSyncWorker::StartSyntheticThread() {
+  if (!vswt_.joinable() && !thread_exit_)
+    vswt_ = std::thread(&VSyncWorker::ThreadFn, this);
+}
+
 void VSyncWorker::SetVsyncPeriodNs(uint32_t vsync_period_ns) {
   const std::lock_guard<std::mutex> lock(mutex_);
   vsync_period_ns_ = vsync_period_ns;
+  model_.Reset(vsync_period_ns);
 }
 
 void VSyncWorker::SetVsyncTimestampTracking(bool enabled) {
@@ -73,15 +100,71 @@ void VSyncWorker::SetVsyncTimestampTracking(bool enabled) {
     if (enabled) {
       // Reset the last timestamp so the caller knows if a vsync timestamp is
       // fresh or not.
-      last_vsync_timestamp_ = 0;
+      PublishVSync(0, vsync_period_ns_,
+                   record_count_.load(std::memory_order_relaxed));
     }
   }
   UpdateVSyncControl();
 }
 
-uint32_t VSyncWorker::GetLastVsyncTimestamp() {
+void VSyncWorker::PublishVSync(int64_t timestamp, uint32_t period_ns,
+                               uint64_t count) {
+  auto seq = record_seq_.load(std::memory_order_relaxed);
+  record_seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record_timestamp_.store(timestamp, std::memory_order_relaxed);
+  record_period_ns_.store(period_ns, std::memory_order_relaxed);
+  record_count_.store(count, std::memory_order_relaxed);
+
+  record_seq_.store(seq + 2, std::memory_order_release);
+}
+
+auto VSyncWorker::GetLastVsync() const -> VSyncRecord {
+  for (;;) {
+    auto seq = record_seq_.load(std::memory_order_acquire);
+    if ((seq & 1) != 0) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    VSyncRecord record = {
+        .timestamp = record_timestamp_.load(std::memory_order_relaxed),
+        .period_ns = record_period_ns_.load(std::memory_order_relaxed),
+        .count = record_count_.load(std::memory_order_relaxed),
+    };
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (record_seq_.load(std::memory_order_relaxed) == seq)
+      return record;
+  }
+}
+
+auto VSyncWorker::GetEstimatedVsyncPeriodNs() -> std::optional<uint32_t> {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  auto period = model_.GetPeriodNs();
+  if (!period)
+    return {};
+
+  return uint32_t(*period);
+}
+
+auto VSyncWorker::GetCommitTime(int64_t present_time)
+    -> std::optional<int64_t> {
+  /* Committed this long after a vsync, the frame still makes the next one */
+  constexpr int64_t kVSyncMarginNs = 500 * 1000;
+
   const std::lock_guard<std::mutex> lock(mutex_);
-  return last_vsync_timestamp_;
+  if (!model_.GetNextVSync(present_time) && last_timestamp_ < 0)
+    return {};
+
+  const int64_t period = model_.GetPeriodNs().value_or(vsync_period_ns_);
+  auto vsync = GetPhasedVSync(period, present_time);
+  /* The expected present time is an estimate, round to the closest vsync */
+  if (vsync - present_time > period / 2)
+    vsync -= period;
+
+  return vsync - period + kVSyncMarginNs;
 }
 
 void VSyncWorker::SetTimestampCallback(
@@ -108,8 +191,9 @@ bool VSyncWorker::ShouldEnable() const {
 };
 
 /*
- * Returns the timestamp of the next vsync in phase with last_timestamp_.
- * For example:
+ * Returns the timestamp of the next vsync predicted by the vsync model, or if
+ * there were no hardware vsyncs yet, the next vsync in phase with
+ * last_timestamp_. For example:
  *  last_timestamp_ = 137
  *  frame_ns = 50
  *  current = 683
@@ -121,6 +205,10 @@ bool VSyncWorker::ShouldEnable() const {
  *  timestamp.
  */
 int64_t VSyncWorker::GetPhasedVSync(int64_t frame_ns, int64_t current) const {
+  auto predicted = model_.GetNextVSync(current);
+  if (predicted)
+    return *predicted;
+
   if (last_timestamp_ < 0)
     return current + frame_ns;
 
@@ -133,7 +221,11 @@ static const int64_t kOneSecondNs = 1LL * 1000 * 1000 * 1000;
 int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
   auto time_now = ResourceManager::GetTimeMonotonicNs();
 
-  auto phased_timestamp = GetPhasedVSync(vsync_period_ns_, time_now);
+  int64_t phased_timestamp = 0;
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    phased_timestamp = GetPhasedVSync(vsync_period_ns_, time_now);
+  }
   struct timespec vsync {};
   vsync.tv_sec = int(phased_timestamp / kOneSecondNs);
   vsync.tv_nsec = int(phased_timestamp - (vsync.tv_sec * kOneSecondNs));
@@ -149,65 +241,183 @@ int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
   return 0;
 }
 
-void VSyncWorker::ThreadFn() {
-  int ret = 0;
+void VSyncWorker::OnVBlankEvent(int64_t timestamp) {
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    vblank_armed_ = false;
+    if (!enabled_)
+      return;
 
+    model_.AddTimestamp(timestamp);
+
+    /* Request the next event, the synthetic vsync takes over on failure */
+    if (!ArmVBlankEvent()) {
+      StartSyntheticThread();
+      cv_.notify_all();
+    }
+  }
+
+  DispatchVSync(timestamp);
+}
+
+void VSyncWorker::DispatchVSync(int64_t timestamp) {
+  std::optional<VsyncTimestampCallback> vsync_callback;
+  uint32_t vsync_period_ns = 0;
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_)
+      return;
+    vsync_callback = callback_;
+    vsync_period_ns = model_.GetPeriodNs().value_or(vsync_period_ns_);
+    if (enable_vsync_timestamps_) {
+      PublishVSync(timestamp, vsync_period_ns,
+                   record_count_.load(std::memory_order_relaxed) + 1);
+    }
+    last_timestamp_ = timestamp;
+  }
+
+  if (vsync_callback) {
+    vsync_callback.value()(timestamp, vsync_period_ns);
+  }
+}
+
+void VSyncWorker::ThreadFn() {
   for (;;) {
     {
       std::unique_lock<std::mutex> lock(mutex_);
       if (thread_exit_)
         break;
 
-      if (!enabled_)
+      /* Idle while the vblank events are delivered */
+      if (!enabled_ || ArmVBlankEvent()) {
         cv_.wait(lock);
-
-      if (!enabled_)
         continue;
+      }
     }
 
-    ret = -EAGAIN;
     int64_t timestamp = 0;
-    drmVBlank vblank{};
+    if (SyntheticWaitVBlank(&timestamp) != 0)
+      continue;
 
-    if (drm_fd_) {
-      vblank.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
-                                               (high_crtc_ &
-                                                DRM_VBLANK_HIGH_CRTC_MASK));
-      vblank.request.sequence = 1;
+    DispatchVSync(timestamp);
+  }
 
-      ret = drmWaitVBlank(*drm_fd_, &vblank);
-      if (ret == -EINTR)
-        continue;
-    }
+  ALOGI("VSyncWorker thread exit");
+}
 
-    if (ret != 0) {
-      ret = SyntheticWaitVBlank(&timestamp);
-      if (ret != 0)
-        continue;
+void VSyncModel::Reset(int64_t nominal_period_ns) {
+  nominal_period_ns_ = nominal_period_ns;
+  period_ns_ = nominal_period_ns;
+  has_estimate_ = false;
+  count_ = 0;
+  next_ = 0;
+  outliers_ = 0;
+}
+
+void VSyncModel::AddTimestamp(int64_t timestamp) {
+  /* Tolerated distance from the predicted vsync, as a fraction of period */
+  constexpr int64_t kOutlierFraction = 5;
+  /* Consecutive outliers, which mean the timing has changed */
+  constexpr int kMaxOutliers = 3;
+  /* Longer gaps may accumulate enough drift to miscount the vsyncs */
+  constexpr int64_t kMaxGapVsyncs = 120;
+
+  int64_t vsync = 0;
+  if (count_ != 0) {
+    const int64_t delta = timestamp - anchor_timestamp_;
+    const int64_t vsyncs = (delta + period_ns_ / 2) / period_ns_;
+    const int64_t error = delta - vsyncs * period_ns_;
+
+    if (vsyncs < 1 || std::abs(error) > period_ns_ / kOutlierFraction) {
+      if (++outliers_ < kMaxOutliers)
+        return;
+
+      Reset(nominal_period_ns_);
+    } else if (vsyncs > kMaxGapVsyncs) {
+      /* Keep the period estimate, drop the phase */
+      count_ = 0;
+      next_ = 0;
     } else {
-      constexpr int kUsToNsMul = 1000;
-      timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
-                  (int64_t)vblank.reply.tval_usec * kUsToNsMul;
+      vsync = anchor_vsync_ + vsyncs;
     }
+  }
 
-    std::optional<VsyncTimestampCallback> vsync_callback;
+  outliers_ = 0;
+  samples_[next_] = {.vsync = vsync, .timestamp = timestamp};
+  next_ = (next_ + 1) % kMaxSamples;
+  count_ = std::min(count_ + 1, kMaxSamples);
+  anchor_vsync_ = vsync;
+  anchor_timestamp_ = timestamp;
 
-    {
-      const std::lock_guard<std::mutex> lock(mutex_);
-      if (!enabled_)
-        continue;
-      if (enable_vsync_timestamps_) {
-        last_vsync_timestamp_ = timestamp;
-      }
-      vsync_callback = callback_;
-    }
+  Fit();
+}
 
-    if (vsync_callback) {
-      vsync_callback.value()(timestamp, vsync_period_ns_);
-    }
-    last_timestamp_ = timestamp;
+void VSyncModel::Fit() {
+  /* The real refresh rate is expected within 1% of the nominal one */
+  constexpr int64_t kMaxDeviationFraction = 100;
+
+  if (count_ < kMinSamples)
+    return;
+
+  const size_t first = (next_ + kMaxSamples - count_) % kMaxSamples;
+  const Sample &origin = samples_[first];
+
+  double mean_x = 0;
+  double mean_y = 0;
+  for (size_t i = 0; i < count_; i++) {
+    const Sample &s = samples_[(first + i) % kMaxSamples];
+    mean_x += double(s.vsync - origin.vsync);
+    mean_y += double(s.timestamp - origin.timestamp);
+  }
+  mean_x /= double(count_);
+  mean_y /= double(count_);
+
+  double sxx = 0;
+  double sxy = 0;
+  for (size_t i = 0; i < count_; i++) {
+    const Sample &s = samples_[(first + i) % kMaxSamples];
+    const double dx = double(s.vsync - origin.vsync) - mean_x;
+    const double dy = double(s.timestamp - origin.timestamp) - mean_y;
+    sxx += dx * dx;
+    sxy += dx * dy;
   }
 
-  ALOGI("VSyncWorker thread exit");
+  if (sxx == 0)
+    return;
+
+  const double slope = sxy / sxx;
+  if (std::abs(slope - double(nominal_period_ns_)) >
+      double(nominal_period_ns_ / kMaxDeviationFraction)) {
+    return;
+  }
+
+  period_ns_ = std::llround(slope);
+  has_estimate_ = true;
+  anchor_timestamp_ = origin.timestamp +
+                      std::llround(mean_y +
+                                   slope * (double(anchor_vsync_ -
+                                                   origin.vsync) -
+                                            mean_x));
+}
+
+auto VSyncModel::GetPeriodNs() const -> std::optional<int64_t> {
+  if (!has_estimate_)
+    return {};
+
+  return period_ns_;
 }
+
+auto VSyncModel::GetNextVSync(int64_t time) const -> std::optional<int64_t> {
+  if (count_ == 0)
+    return {};
+
+  const int64_t elapsed = time - anchor_timestamp_;
+  int64_t vsyncs = elapsed / period_ns_;
+  if (elapsed % period_ns_ < 0)
+    vsyncs--;
+
+  return anchor_timestamp_ + (vsyncs + 1) * period_ns_;
+}
+
 }  // namespace android
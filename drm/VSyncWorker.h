@@ -16,16 +16,62 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <map>
 #include <mutex>
+#include <optional>
 #include <thread>
 
 #include "DrmDevice.h"
+#include "DrmEventListener.h"
 
 namespace android {
 
+/* Online estimate of the real vsync period and phase. A least squares line is
+ * fitted through the recent hardware vsync timestamps against their vsync
+ * numbers, timestamps too far off the prediction are rejected as outliers.
+ */
+class VSyncModel {
+ public:
+  explicit VSyncModel(int64_t nominal_period_ns) {
+    Reset(nominal_period_ns);
+  }
+
+  void Reset(int64_t nominal_period_ns);
+  void AddTimestamp(int64_t timestamp);
+
+  /* Estimated period, nullopt until enough timestamps are collected */
+  auto GetPeriodNs() const -> std::optional<int64_t>;
+  /* Predicted vsync following the time, nullopt without timestamps */
+  auto GetNextVSync(int64_t time) const -> std::optional<int64_t>;
+
+ private:
+  void Fit();
+
+  static constexpr size_t kMaxSamples = 32;
+  static constexpr size_t kMinSamples = 6;
+
+  struct Sample {
+    int64_t vsync;
+    int64_t timestamp;
+  };
+  std::array<Sample, kMaxSamples> samples_{};
+  size_t count_{};
+  size_t next_{};
+  int outliers_{};
+
+  int64_t nominal_period_ns_{};
+  int64_t period_ns_{};
+  bool has_estimate_{};
+
+  /* Vsync of the newest sample and its fitted timestamp */
+  int64_t anchor_vsync_{};
+  int64_t anchor_timestamp_{};
+};
+
 class VSyncWorker {
  public:
   using VsyncTimestampCallback = std::function<void(int64_t /*timestamp*/,
@@ -42,28 +88,54 @@ class VSyncWorker {
   // Set or clear a callback to be fired on vsync.
   void SetTimestampCallback(std::optional<VsyncTimestampCallback> &&callback);
 
+  struct VSyncRecord {
+    int64_t timestamp;
+    uint32_t period_ns;
+    uint64_t count;
+  };
+
   // Enable vsync timestamp tracking. GetLastVsyncTimestamp will return 0 if
   // vsync tracking is disabled, or if no vsync has happened since it was
   // enabled.
   void SetVsyncTimestampTracking(bool enabled);
-  uint32_t GetLastVsyncTimestamp();
+  int64_t GetLastVsyncTimestamp() const {
+    return GetLastVsync().timestamp;
+  }
+
+  // Last tracked vsync and the number of tracked vsyncs. Lock-free, may be
+  // called from any thread.
+  auto GetLastVsync() const -> VSyncRecord;
+
+  // Period measured from the vsync timestamps, nullopt if not known yet.
+  auto GetEstimatedVsyncPeriodNs() -> std::optional<uint32_t>;
+
+  // Earliest time a commit is latched at the vsync closest to |present_time|
+  // instead of the one before, nullopt while the vsync phase is unknown.
+  auto GetCommitTime(int64_t present_time) -> std::optional<int64_t>;
 
   void StopThread();
 
  private:
   VSyncWorker() = default;
 
+  /* Synthetic vsync, runs only when the vblank events are not available */
   void ThreadFn();
 
+  void OnVBlankEvent(int64_t timestamp);
+  void DispatchVSync(int64_t timestamp);
+
   int64_t GetPhasedVSync(int64_t frame_ns, int64_t current) const;
   int SyntheticWaitVBlank(int64_t *timestamp);
 
   // Must hold the lock before calling these.
   void UpdateVSyncControl();
   bool ShouldEnable() const;
+  bool ArmVBlankEvent();
+  void StartSyntheticThread();
 
-  SharedFd drm_fd_;
-  uint32_t high_crtc_ = 0;
+  DrmEventListener *event_listener_{};
+  uint32_t crtc_index_ = 0;
+  bool vblank_armed_ = false;
 
   bool enabled_ = false;
   bool thread_exit_ = false;
@@ -73,8 +145,15 @@ class VSyncWorker {
   static constexpr uint32_t kDefaultVSPeriodNs = 16666666;
   // Needs to be threadsafe.
   uint32_t vsync_period_ns_ = kDefaultVSPeriodNs;
+  VSyncModel model_{kDefaultVSPeriodNs};
   bool enable_vsync_timestamps_ = false;
-  uint32_t last_vsync_timestamp_ = 0;
+  // Seqlock, written with the lock held: odd sequence means a write is in
+  // progress.
+  void PublishVSync(int64_t timestamp, uint32_t period_ns, uint64_t count);
+  std::atomic<uint32_t> record_seq_ = 0;
+  std::atomic<int64_t> record_timestamp_ = 0;
+  std::atomic<uint32_t> record_period_ns_ = 0;
+  std::atomic<uint64_t> record_count_ = 0;
   std::optional<VsyncTimestampCallback> callback_;
 
   std::condition_variable cv_;
@@ -38,7 +38,7 @@ HWC2::Error DrmHwcTwo::RegisterCallback(int32_t descriptor,
         /* Headless display may still be here. Remove it! */
         if (Displays().count(kPrimaryDisplay) != 0) {
           Displays()[kPrimaryDisplay]->Deinit();
-          Displays().erase(kPrimaryDisplay);
+          EraseDisplay(kPrimaryDisplay);
         }
       }
       break;
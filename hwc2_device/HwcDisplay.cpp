@@ -20,6 +20,7 @@
 #include "HwcDisplay.h"
 
 #include <cinttypes>
+#include <ctime>
 
 #include <hardware/gralloc.h>
 #include <ui/GraphicBufferAllocator.h>
@@ -127,6 +128,7 @@ std::string HwcDisplay::DumpDelta(HwcDisplay::Stats delta) {
 }
 
 std::string HwcDisplay::Dump() {
+  const std::lock_guard<std::recursive_mutex> lock(lock_);
   auto connector_name = IsInHeadlessMode()
                             ? std::string("NULL-DISPLAY")
                             : GetPipe().connector->Get()->GetName();
@@ -138,6 +140,22 @@ std::string HwcDisplay::Dump() {
      << "Statistics since last dumpsys request:\n"
      << DumpDelta(total_stats_.minus(prev_stats_)) << "\n\n";
 
+  if (!IsInHeadlessMode()) {
+    auto fb_stats = GetPipe().device->GetDrmFbImporter().GetStats();
+    ss << "Framebuffer cache (shared by the displays of the device):\n"
+       << " Hits: " << fb_stats.hits << " / Misses: " << fb_stats.misses
+       << " / Evictions: " << fb_stats.evictions << "\n"
+       << " Recently used: " << fb_stats.lru_entries << " framebuffers, "
+       << fb_stats.lru_bytes / 1024 << " KiB\n\n"
+       << GetPipe().device->GetPlaneArbiter().Dump() << "\n";
+  }
+
+  if (flatcon_) {
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        flatcon_->GetTimeout());
+    ss << "Flattening timeout: " << timeout.count() << " ms\n\n";
+  }
+
   memcpy(&prev_stats_, &total_stats_, sizeof(Stats));
   return ss.str();
 }
@@ -271,7 +289,9 @@ auto HwcDisplay::QueueConfig(hwc2_config_t config, int64_t desired_time,
 }
 
 void HwcDisplay::SetPipeline(std::shared_ptr<DrmDisplayPipeline> pipeline) {
+  const std::lock_guard<std::recursive_mutex> lock(lock_);
   Deinit();
+  dirty_ |= kDirtyPipeline;
 
   pipeline_ = std::move(pipeline);
 
@@ -284,6 +304,7 @@ void HwcDisplay::SetPipeline(std::shared_ptr<DrmDisplayPipeline> pipeline) {
 }
 
 void HwcDisplay::Deinit() {
+  const std::lock_guard<std::recursive_mutex> lock(lock_);
   if (pipeline_ != nullptr) {
     AtomicCommitArgs a_args{};
     a_args.composition = std::make_shared<DrmKmsPlan>();
@@ -295,6 +316,7 @@ void HwcDisplay::Deinit() {
     current_plan_.reset();
     backend_.reset();
     if (flatcon_) {
+      GetPipe().device->GetPlaneArbiter().UnregisterPipeline(pipeline_.get());
       flatcon_->StopThread();
       flatcon_.reset();
     }
@@ -328,6 +350,20 @@ HWC2::Error HwcDisplay::Init() {
     auto flatcbk = (struct FlatConCallbacks){
         .trigger = [this]() { hwc_->SendRefreshEventToClient(handle_); }};
     flatcon_ = FlatteningController::CreateInstance(flatcbk);
+    /* Called by other displays without the display lock */
+    auto arbiter_client = DrmPlaneArbiter::Client{
+        .replan =
+            [hwc = hwc_, handle = handle_, revoked = planes_revoked_]() {
+              *revoked = true;
+              hwc->SendRefreshEventToClient(handle);
+            },
+        .release_if_idle =
+            [flatcon = std::weak_ptr<FlatteningController>(flatcon_)]() {
+              auto fc = flatcon.lock();
+              return fc && fc->RequestFlatten();
+            }};
+    GetPipe().device->GetPlaneArbiter().RegisterPipeline(pipeline_.get(),
+                                                         arbiter_client);
   }
 
   client_layer_.SetLayerBlendMode(HWC2_BLEND_MODE_PREMULTIPLIED);
@@ -377,18 +413,19 @@ HWC2::Error HwcDisplay::AcceptDisplayChanges() {
 }
 
 HWC2::Error HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
-  layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer(this));
-  *layer = static_cast<hwc2_layer_t>(layer_idx_);
-  ++layer_idx_;
+  dirty_ |= kDirtyLayerStack;
+  layer_stack_changed_ = true;
+  *layer = layers_.Emplace(this);
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
-  if (!get_layer(layer)) {
+  if (!layers_.Erase(layer)) {
     return HWC2::Error::BadLayer;
   }
 
-  layers_.erase(layer);
+  dirty_ |= kDirtyLayerStack;
+  layer_stack_changed_ = true;
   return HWC2::Error::None;
 }
 
@@ -679,40 +716,29 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
     }
   }
 
-  // order the layers by z-order
+  const auto &ordered_layers = GetOrderLayersByZPos();
+  std::vector<LayerData> composition_layers;
+  composition_layers.reserve(ordered_layers.size() + 1);
+
   bool use_client_layer = false;
-  uint32_t client_z_order = UINT32_MAX;
-  std::map<uint32_t, HwcLayer *> z_map;
-  for (std::pair<const hwc2_layer_t, HwcLayer> &l : layers_) {
-    switch (l.second.GetValidatedType()) {
+  for (auto *layer : ordered_layers) {
+    switch (layer->GetValidatedType()) {
       case HWC2::Composition::Device:
-        z_map.emplace(l.second.GetZOrder(), &l.second);
         break;
       case HWC2::Composition::Client:
         // Place it at the z_order of the lowest client layer
+        if (use_client_layer)
+          continue;
         use_client_layer = true;
-        client_z_order = std::min(client_z_order, l.second.GetZOrder());
+        layer = &client_layer_;
         break;
       default:
         continue;
     }
-  }
-  if (use_client_layer)
-    z_map.emplace(client_z_order, &client_layer_);
-
-  if (z_map.empty())
-    return HWC2::Error::BadLayer;
 
-  std::vector<LayerData> composition_layers;
-
-  /* Import & populate */
-  for (std::pair<const uint32_t, HwcLayer *> &l : z_map) {
-    l.second->PopulateLayerData();
-  }
-
-  // now that they're ordered by z, add them to the composition
-  for (std::pair<const uint32_t, HwcLayer *> &l : z_map) {
-    if (!l.second->IsLayerUsableAsDevice()) {
+    /* Import & populate */
+    layer->PopulateLayerData();
+    if (!layer->IsLayerUsableAsDevice()) {
       /* This will be normally triggered on validation of the first frame
        * containing CLIENT layer. At this moment client buffer is not yet
        * provided by the CLIENT.
@@ -722,9 +748,12 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
        */
       return HWC2::Error::BadLayer;
     }
-    composition_layers.emplace_back(l.second->GetLayerData());
+    composition_layers.emplace_back(layer->GetLayerData());
   }
 
+  if (composition_layers.empty())
+    return HWC2::Error::BadLayer;
+
   /* Store plan to ensure shared planes won't be stolen by other display
    * in between of ValidateDisplay() and PresentDisplay() calls
    */
@@ -756,7 +785,7 @@ HWC2::Error HwcDisplay::CreateComposition(AtomicCommitArgs &a_args) {
     staged_mode_config_id_.reset();
 
     vsync_worker_->SetVsyncTimestampTracking(false);
-    uint32_t last_vsync_ts = vsync_worker_->GetLastVsyncTimestamp();
+    int64_t last_vsync_ts = vsync_worker_->GetLastVsyncTimestamp();
     if (last_vsync_ts != 0) {
       hwc_->SendVsyncPeriodTimingChangedEventToClient(handle_,
                                                       last_vsync_ts +
@@ -779,11 +808,18 @@ HWC2::Error HwcDisplay::PresentDisplay(int32_t *out_present_fence) {
 
   ++total_stats_.total_frames_;
 
+  if (expected_present_time_) {
+    WaitForPresentTime(*expected_present_time_);
+    expected_present_time_.reset();
+  }
+
   AtomicCommitArgs a_args{};
   ret = CreateComposition(a_args);
 
-  if (ret != HWC2::Error::None)
+  if (ret != HWC2::Error::None) {
     ++total_stats_.failed_kms_present_;
+    validated_ = false;
+  }
 
   if (ret == HWC2::Error::BadLayer) {
     // Can we really have no client or device layers?
@@ -804,6 +840,37 @@ HWC2::Error HwcDisplay::PresentDisplay(int32_t *out_present_fence) {
   return HWC2::Error::None;
 }
 
+/* There is no way to delay the presentation in the DRM API. The frame is held
+ * until the vsync preceding the expected present time, so it is latched at
+ * the expected vsync and not a vsync early.
+ */
+void HwcDisplay::WaitForPresentTime(int64_t expected_present_time) {
+  if (!vsync_worker_)
+    return;
+
+  auto commit_time = vsync_worker_->GetCommitTime(expected_present_time);
+  if (!commit_time)
+    return;
+
+  auto delay_ns = *commit_time - ResourceManager::GetTimeMonotonicNs();
+  if (delay_ns <= 0)
+    return;
+
+  constexpr int64_t kOneSecondNs = 1000LL * 1000 * 1000;
+  if (delay_ns > kOneSecondNs) {
+    ALOGW("Expected present time is %" PRIi64 " ns ahead, ignoring it",
+          delay_ns);
+    return;
+  }
+
+  struct timespec deadline {};
+  deadline.tv_sec = time_t(*commit_time / kOneSecondNs);
+  deadline.tv_nsec = *commit_time % kOneSecondNs;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) ==
+         EINTR) {
+  }
+}
+
 HWC2::Error HwcDisplay::SetActiveConfigInternal(uint32_t config,
                                                 int64_t change_time) {
   if (configs_.hwc_configs.count(config) == 0) {
@@ -813,6 +880,7 @@ HWC2::Error HwcDisplay::SetActiveConfigInternal(uint32_t config,
 
   staged_mode_change_time_ = change_time;
   staged_mode_config_id_ = config;
+  dirty_ |= kDirtyConfig;
 
   return HWC2::Error::None;
 }
@@ -897,6 +965,9 @@ HWC2::Error HwcDisplay::SetColorMode(int32_t mode) {
       return HWC2::Error::Unsupported;
   }
 
+  if (color_mode_ != mode)
+    dirty_ |= kDirtyColorMode;
+
   color_mode_ = mode;
   return HWC2::Error::None;
 }
@@ -921,6 +992,7 @@ HWC2::Error HwcDisplay::SetColorTransform(const float *matrix, int32_t hint) {
     return HWC2::Error::BadParameter;
 
   color_transform_hint_ = static_cast<android_color_transform_t>(hint);
+  dirty_ |= kDirtyColorTransform;
 
   if (IsInHeadlessMode())
     return HWC2::Error::None;
@@ -1081,30 +1153,137 @@ HWC2::Error HwcDisplay::ValidateDisplay(uint32_t *num_types,
                                        HWC2::Composition::Client);
   }
 
-  return backend_->ValidateDisplay(this, num_types, num_requests);
+  if (planes_revoked_->exchange(false))
+    dirty_ |= kDirtyPlanes;
+
+  auto ret = backend_->ValidateDisplay(this, num_types, num_requests);
+
+  validated_ = ret == HWC2::Error::None || ret == HWC2::Error::HasChanges;
+  dirty_ = 0;
+  for (auto &l : layers_) {
+    l.second.ClearDirtyBits();
+  }
+
+  return ret;
 }
 
-std::vector<HwcLayer *> HwcDisplay::GetOrderLayersByZPos() {
-  std::vector<HwcLayer *> ordered_layers;
-  ordered_layers.reserve(layers_.size());
+uint32_t HwcDisplay::GetDirtyBits() const {
+  uint32_t dirty = dirty_;
+  if (*planes_revoked_)
+    dirty |= kDirtyPlanes;
+  for (const auto &l : layers_) {
+    dirty |= l.second.GetDirtyBits();
+  }
+  return dirty;
+}
 
+bool HwcDisplay::SkipValidate() {
+  if (IsInHeadlessMode() || !validated_ || staged_mode_config_id_ ||
+      layers_.empty() || (GetDirtyBits() & ~HwcLayer::kDirtyBuffer) != 0) {
+    return false;
+  }
+
+  /* Flattening requires composition types to be changed */
+  if (flatcon_ && flatcon_->ShouldFlatten())
+    return false;
+
+  /* Client target buffer is not provided without validation */
   for (auto &[handle, layer] : layers_) {
-    ordered_layers.emplace_back(&layer);
+    if (layer.GetValidatedType() != HWC2::Composition::Device ||
+        layer.IsTypeChanged()) {
+      return false;
+    }
   }
 
-  std::sort(std::begin(ordered_layers), std::end(ordered_layers),
-            [](const HwcLayer *lhs, const HwcLayer *rhs) {
-              return lhs->GetZOrder() < rhs->GetZOrder();
-            });
+  /* New buffers may have different format or size */
+  AtomicCommitArgs a_args = {.test_only = true};
+  if (CreateComposition(a_args) != HWC2::Error::None)
+    return false;
+
+  for (auto &l : layers_) {
+    l.second.SetPriorBufferScanOutFlag(true);
+  }
 
-  return ordered_layers;
+  UpdateFlattening();
+
+  return true;
+}
+
+bool HwcDisplay::UpdateFlattening() {
+  if (!flatcon_)
+    return false;
+
+  auto now = ResourceManager::GetTimeMonotonicNs();
+  auto frequent_interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               FlatteningController::kFrequentUpdateInterval)
+                               .count();
+
+  size_t static_layers = 0;
+  bool static_content_changed = false;
+  for (auto &[handle, layer] : layers_) {
+    auto changed = layer.CommitContentUpdate(now, frequent_interval);
+    if (layer.IsFrequentlyUpdated())
+      continue;
+
+    static_layers++;
+    static_content_changed |= changed;
+  }
+
+  /* Merging a single layer does not free any plane */
+  if (static_layers <= 1) {
+    flatcon_->Disable();
+    return false;
+  }
+
+  return flatcon_->NewFrame(static_content_changed);
+}
+
+auto HwcDisplay::GetOrderLayersByZPos() -> const std::vector<HwcLayer *> & {
+  if (layer_stack_changed_) {
+    z_ordered_layers_.clear();
+    for (auto &[handle, layer] : layers_) {
+      z_ordered_layers_.emplace_back(&layer);
+    }
+    layer_stack_changed_ = false;
+    z_order_changed_ = true;
+  }
+
+  /* Usually only a few layers move, insertion sort is linear then */
+  if (z_order_changed_) {
+    for (size_t i = 1; i < z_ordered_layers_.size(); i++) {
+      auto *layer = z_ordered_layers_[i];
+      auto z_order = layer->GetZOrder();
+      auto j = i;
+      while (j > 0 && z_ordered_layers_[j - 1]->GetZOrder() > z_order) {
+        z_ordered_layers_[j] = z_ordered_layers_[j - 1];
+        j--;
+      }
+      z_ordered_layers_[j] = layer;
+    }
+    z_order_changed_ = false;
+  }
+
+  return z_ordered_layers_;
 }
 
 HWC2::Error HwcDisplay::GetDisplayVsyncPeriod(
     uint32_t *outVsyncPeriod /* ns */) {
-  return GetDisplayAttribute(configs_.active_config_id,
-                             HWC2_ATTRIBUTE_VSYNC_PERIOD,
-                             (int32_t *)(outVsyncPeriod));
+  auto err = GetDisplayAttribute(configs_.active_config_id,
+                                 HWC2_ATTRIBUTE_VSYNC_PERIOD,
+                                 (int32_t *)(outVsyncPeriod));
+  if (err != HWC2::Error::None)
+    return err;
+
+  /* The real refresh rate of the panel often differs from the nominal one,
+   * e.g. 59.94 Hz instead of 60 Hz.
+   */
+  if (vsync_worker_) {
+    auto estimated_period = vsync_worker_->GetEstimatedVsyncPeriodNs();
+    if (estimated_period)
+      *outVsyncPeriod = *estimated_period;
+  }
+
+  return HWC2::Error::None;
 }
 
 #if __ANDROID_API__ > 29
@@ -19,6 +19,7 @@
 #include <hardware/hwcomposer2.h>
 
 #include <atomic>
+#include <mutex>
 #include <optional>
 #include <sstream>
 
@@ -30,6 +31,7 @@
 #include "drm/ResourceManager.h"
 #include "drm/VSyncWorker.h"
 #include "hwc2_device/HwcLayer.h"
+#include "utils/SlotMap.h"
 
 namespace android {
 
@@ -48,6 +50,19 @@ class HwcDisplay {
     kSeamlessNotPossible
   };
 
+  /* Display state changed since the last validation. Combined with the
+   * HwcLayer::DirtyBits of every layer by GetDirtyBits().
+   */
+  enum DirtyBits : uint32_t {
+    kDirtyLayerStack = 1 << 16, /* layer created or destroyed */
+    kDirtyColorTransform = 1 << 17,
+    kDirtyColorMode = 1 << 18,
+    kDirtyConfig = 1 << 19,
+    kDirtyPipeline = 1 << 20,
+    kDirtyPlanes = 1 << 21, /* overlays taken by other displays */
+    kDirtyAll = ((1 << 22) - 1) & ~((1 << 16) - 1),
+  };
+
   HwcDisplay(hwc2_display_t handle, HWC2::DisplayType type, DrmHwc *hwc);
   HwcDisplay(const HwcDisplay &) = delete;
   ~HwcDisplay();
@@ -55,8 +70,20 @@ class HwcDisplay {
   /* SetPipeline should be carefully used only by DrmHwcTwo hotplug handlers */
   void SetPipeline(std::shared_ptr<DrmDisplayPipeline> pipeline);
 
+  /* Serializes the composer calls for this display. Taken after the device
+   * lock of the ResourceManager, never the other way around.
+   */
+  auto &GetLock() {
+    return lock_;
+  }
+
   HWC2::Error CreateComposition(AtomicCommitArgs &a_args);
-  std::vector<HwcLayer *> GetOrderLayersByZPos();
+  /* Valid until the layer stack or a z-order changes */
+  auto GetOrderLayersByZPos() -> const std::vector<HwcLayer *> &;
+  /* Called by the layers of the display when their z-order changes */
+  void InvalidateZOrder() {
+    z_order_changed_ = true;
+  }
 
   void ClearDisplay();
 
@@ -153,11 +180,21 @@ class HwcDisplay {
   HWC2::Error SetPowerMode(int32_t mode);
   HWC2::Error SetVsyncEnabled(int32_t enabled);
   HWC2::Error ValidateDisplay(uint32_t *num_types, uint32_t *num_requests);
+  /* Returns true if the frame can be presented using the composition types of
+   * the last validated frame, i.e. only layer buffers have changed since then.
+   */
+  bool SkipValidate();
+  /* Feeds the layer content updates of the new frame to the flattening
+   * controller. Returns true if the static layers should be flattened.
+   */
+  bool UpdateFlattening();
+  /* The next presented frame is not shown earlier than this time */
+  void SetExpectedPresentTime(std::optional<int64_t> expected_present_time) {
+    expected_present_time_ = expected_present_time;
+  }
+  uint32_t GetDirtyBits() const;
   HwcLayer *get_layer(hwc2_layer_t layer) {
-    auto it = layers_.find(layer);
-    if (it == layers_.end())
-      return nullptr;
-    return &it->second;
+    return layers_.Find(layer);
   }
 
   /* Statistics */
@@ -186,7 +223,7 @@ class HwcDisplay {
     return hwc_;
   }
 
-  std::map<hwc2_layer_t, HwcLayer> &layers() {
+  SlotMap<HwcLayer> &layers() {
     return layers_;
   }
 
@@ -232,11 +269,14 @@ class HwcDisplay {
       const HwcDisplayConfig *config,
       const std::optional<LayerData> &modeset_layer);
 
+  void WaitForPresentTime(int64_t expected_present_time);
+
   HwcDisplayConfigs configs_;
 
   DrmHwc *const hwc_;
 
   SharedFd present_fence_;
+  std::optional<int64_t> expected_present_time_;
 
   int64_t staged_mode_change_time_{};
   std::optional<uint32_t> staged_mode_config_id_{};
@@ -252,9 +292,26 @@ class HwcDisplay {
   const hwc2_display_t handle_;
   HWC2::DisplayType type_;
 
-  uint32_t layer_idx_{};
+  /* Set when the last validation succeeded and its plan was not rejected */
+  bool validated_{};
+  uint32_t dirty_ = kDirtyAll;
+  /* Set by the plane arbiter, which does not take the display lock. Shared
+   * with its callbacks, which may outlive the display.
+   */
+  const std::shared_ptr<std::atomic_bool> planes_revoked_ =
+      std::make_shared<std::atomic_bool>();
+
+  std::recursive_mutex lock_;
 
-  std::map<hwc2_layer_t, HwcLayer> layers_;
+  /* Looked up by every layer command, see SlotMap */
+  SlotMap<HwcLayer> layers_;
+  /* Persistent z-order index of layers_. Rebuilt when a layer is created or
+   * destroyed, as SlotMap may move the layers, re-sorted when a z-order
+   * changes.
+   */
+  std::vector<HwcLayer *> z_ordered_layers_;
+  bool layer_stack_changed_ = true;
+  bool z_order_changed_ = true;
   HwcLayer client_layer_;
   std::unique_ptr<HwcLayer> writeback_layer_;
   uint16_t virtual_disp_width_{};
@@ -14,49 +14,102 @@
  * limitations under the License.
  */
 
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #define LOG_TAG "drmhwc"
 
 #include "HwcLayer.h"
 
+#include <utils/Trace.h>
+
+#include <algorithm>
+
 #include "HwcDisplay.h"
 #include "bufferinfo/BufferInfoGetter.h"
 #include "utils/log.h"
 
 namespace android {
 
-void HwcLayer::SetLayerProperties(const LayerProperties& layer_properties) {
+namespace {
+
+template <typename T>
+bool IsSame(const T &a, const T &b) {
+  return a == b;
+}
+
+template <>
+bool IsSame(const hwc_rect_t &a, const hwc_rect_t &b) {
+  return a.left == b.left && a.top == b.top && a.right == b.right &&
+         a.bottom == b.bottom;
+}
+
+template <>
+bool IsSame(const hwc_frect_t &a, const hwc_frect_t &b) {
+  return a.left == b.left && a.top == b.top && a.right == b.right &&
+         a.bottom == b.bottom;
+}
+
+/* Assigns the value, marking the layer state dirty if it has changed */
+template <typename T>
+void Update(T &field, const T &value, uint32_t &dirty, uint32_t dirty_bit) {
+  if (!IsSame(field, value)) {
+    field = value;
+    dirty |= dirty_bit;
+  }
+}
+
+}  // namespace
+
+void HwcLayer::SetLayerProperties(LayerProperties layer_properties) {
   if (layer_properties.buffer) {
     layer_data_.acquire_fence = layer_properties.buffer->acquire_fence;
     buffer_handle_ = layer_properties.buffer->buffer_handle;
     buffer_handle_updated_ = true;
+    buffer_updated_ = true;
+    dirty_ |= kDirtyBuffer;
+    RequestFbImport();
+  }
+  if (layer_properties.damage) {
+    damage_ = std::move(layer_properties.damage.value());
+  }
+  if (layer_properties.visible_region) {
+    visible_region_ = std::move(layer_properties.visible_region.value());
   }
   if (layer_properties.blend_mode) {
-    blend_mode_ = layer_properties.blend_mode.value();
+    Update(blend_mode_, layer_properties.blend_mode.value(), dirty_,
+           kDirtyBlending);
   }
   if (layer_properties.color_space) {
-    color_space_ = layer_properties.color_space.value();
+    Update(color_space_, layer_properties.color_space.value(), dirty_,
+           kDirtyDataspace);
   }
   if (layer_properties.sample_range) {
-    sample_range_ = layer_properties.sample_range.value();
+    Update(sample_range_, layer_properties.sample_range.value(), dirty_,
+           kDirtyDataspace);
   }
   if (layer_properties.composition_type) {
-    sf_type_ = layer_properties.composition_type.value();
+    Update(sf_type_, layer_properties.composition_type.value(), dirty_,
+           kDirtyCompositionType);
   }
   if (layer_properties.display_frame) {
-    layer_data_.pi.display_frame = layer_properties.display_frame.value();
+    Update(layer_data_.pi.display_frame, layer_properties.display_frame.value(),
+           dirty_, kDirtyGeometry);
   }
   if (layer_properties.alpha) {
-    layer_data_.pi.alpha = std::lround(layer_properties.alpha.value() *
-                                       UINT16_MAX);
+    Update(layer_data_.pi.alpha,
+           uint16_t(std::lround(layer_properties.alpha.value() * UINT16_MAX)),
+           dirty_, kDirtyBlending);
   }
   if (layer_properties.source_crop) {
-    layer_data_.pi.source_crop = layer_properties.source_crop.value();
+    Update(layer_data_.pi.source_crop, layer_properties.source_crop.value(),
+           dirty_, kDirtyGeometry);
   }
   if (layer_properties.transform) {
-    layer_data_.pi.transform = layer_properties.transform.value();
+    Update(layer_data_.pi.transform, layer_properties.transform.value(), dirty_,
+           kDirtyGeometry);
   }
   if (layer_properties.z_order) {
-    z_order_ = layer_properties.z_order.value();
+    UpdateZOrder(layer_properties.z_order.value());
   }
 }
 
@@ -66,21 +119,23 @@ HWC2::Error HwcLayer::SetCursorPosition(int32_t /*x*/, int32_t /*y*/) {
 }
 
 HWC2::Error HwcLayer::SetLayerBlendMode(int32_t mode) {
+  BufferBlendMode blend_mode{};
   switch (static_cast<HWC2::BlendMode>(mode)) {
     case HWC2::BlendMode::None:
-      blend_mode_ = BufferBlendMode::kNone;
+      blend_mode = BufferBlendMode::kNone;
       break;
     case HWC2::BlendMode::Premultiplied:
-      blend_mode_ = BufferBlendMode::kPreMult;
+      blend_mode = BufferBlendMode::kPreMult;
       break;
     case HWC2::BlendMode::Coverage:
-      blend_mode_ = BufferBlendMode::kCoverage;
+      blend_mode = BufferBlendMode::kCoverage;
       break;
     default:
       ALOGE("Unknown blending mode b=%d", mode);
-      blend_mode_ = BufferBlendMode::kUndefined;
+      blend_mode = BufferBlendMode::kUndefined;
       break;
   }
+  Update(blend_mode_, blend_mode, dirty_, kDirtyBlending);
   return HWC2::Error::None;
 }
 
@@ -92,6 +147,9 @@ HWC2::Error HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
   layer_data_.acquire_fence = MakeSharedFd(acquire_fence);
   buffer_handle_ = buffer;
   buffer_handle_updated_ = true;
+  buffer_updated_ = true;
+  dirty_ |= kDirtyBuffer;
+  RequestFbImport();
 
   return HWC2::Error::None;
 }
@@ -103,11 +161,15 @@ HWC2::Error HwcLayer::SetLayerColor(hwc_color_t /*color*/) {
 }
 
 HWC2::Error HwcLayer::SetLayerCompositionType(int32_t type) {
-  sf_type_ = static_cast<HWC2::Composition>(type);
+  Update(sf_type_, static_cast<HWC2::Composition>(type), dirty_,
+         kDirtyCompositionType);
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerDataspace(int32_t dataspace) {
+  const auto prev_color_space = color_space_;
+  const auto prev_sample_range = sample_range_;
+
   switch (dataspace & HAL_DATASPACE_STANDARD_MASK) {
     case HAL_DATASPACE_STANDARD_BT709:
       color_space_ = BufferColorSpace::kItuRec709;
@@ -136,16 +198,21 @@ HWC2::Error HwcLayer::SetLayerDataspace(int32_t dataspace) {
     default:
       sample_range_ = BufferSampleRange::kUndefined;
   }
+
+  if (color_space_ != prev_color_space || sample_range_ != prev_sample_range)
+    dirty_ |= kDirtyDataspace;
+
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerDisplayFrame(hwc_rect_t frame) {
-  layer_data_.pi.display_frame = frame;
+  Update(layer_data_.pi.display_frame, frame, dirty_, kDirtyGeometry);
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerPlaneAlpha(float alpha) {
-  layer_data_.pi.alpha = std::lround(alpha * UINT16_MAX);
+  Update(layer_data_.pi.alpha, uint16_t(std::lround(alpha * UINT16_MAX)),
+         dirty_, kDirtyBlending);
   return HWC2::Error::None;
 }
 
@@ -157,13 +224,12 @@ HWC2::Error HwcLayer::SetLayerSidebandStream(
 }
 
 HWC2::Error HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
-  layer_data_.pi.source_crop = crop;
+  Update(layer_data_.pi.source_crop, crop, dirty_, kDirtyGeometry);
   return HWC2::Error::None;
 }
 
-// NOLINTNEXTLINE(readability-convert-member-functions-to-static)
-HWC2::Error HwcLayer::SetLayerSurfaceDamage(hwc_region_t /*damage*/) {
-  // TODO(nobody): We don't use surface damage, marking as unsupported
+HWC2::Error HwcLayer::SetLayerSurfaceDamage(hwc_region_t damage) {
+  damage_.assign(damage.rects, damage.rects + damage.numRects);
   return HWC2::Error::None;
 }
 
@@ -187,21 +253,84 @@ HWC2::Error HwcLayer::SetLayerTransform(int32_t transform) {
       l_transform |= LayerTransform::kRotate90;
   }
 
-  layer_data_.pi.transform = static_cast<LayerTransform>(l_transform);
+  Update(layer_data_.pi.transform, static_cast<LayerTransform>(l_transform),
+         dirty_, kDirtyGeometry);
   return HWC2::Error::None;
 }
 
-// NOLINTNEXTLINE(readability-convert-member-functions-to-static)
-HWC2::Error HwcLayer::SetLayerVisibleRegion(hwc_region_t /*visible*/) {
-  // TODO(nobody): We don't use this information, marking as unsupported
+HWC2::Error HwcLayer::SetLayerVisibleRegion(hwc_region_t visible) {
+  visible_region_.emplace(visible.rects, visible.rects + visible.numRects);
   return HWC2::Error::None;
 }
 
 HWC2::Error HwcLayer::SetLayerZOrder(uint32_t order) {
-  z_order_ = order;
+  UpdateZOrder(order);
   return HWC2::Error::None;
 }
 
+void HwcLayer::UpdateZOrder(uint32_t z_order) {
+  if (z_order_ == z_order)
+    return;
+
+  z_order_ = z_order;
+  dirty_ |= kDirtyZOrder;
+  parent_->InvalidateZOrder();
+}
+
+/* A single empty rectangle tells that the new buffer has the same content */
+bool HwcLayer::IsDamageEmpty() const {
+  return damage_.size() == 1 && IsSame(damage_[0], hwc_rect_t{});
+}
+
+bool HwcLayer::IsVisible() const {
+  if (!visible_region_)
+    return true;
+
+  return std::any_of(visible_region_->begin(), visible_region_->end(),
+                     [](const hwc_rect_t &r) {
+                       return r.right > r.left && r.bottom > r.top;
+                     });
+}
+
+bool HwcLayer::CommitContentUpdate(int64_t now_ns,
+                                   int64_t frequent_interval_ns) {
+  content_updated_ = buffer_updated_ && !IsDamageEmpty() && IsVisible();
+  buffer_updated_ = false;
+
+  if (content_updated_) {
+    update_interval_ns_ = last_update_ns_ != 0 ? now_ns - last_update_ns_
+                                               : INT64_MAX;
+    last_update_ns_ = now_ns;
+  }
+
+  frequently_updated_ = last_update_ns_ != 0 &&
+                        now_ns - last_update_ns_ < frequent_interval_ns &&
+                        update_interval_ns_ < frequent_interval_ns;
+
+  return content_updated_;
+}
+
+void HwcLayer::RequestFbImport() {
+  /* The job may still read the previous handle, which can be released as
+   * soon as it is replaced
+   */
+  if (pending_import_.valid())
+    pending_import_.wait();
+  pending_import_ = {};
+
+  if (!IsLayerUsableAsDevice() || parent_->IsInHeadlessMode()) {
+    return;
+  }
+
+  auto unique_id = BufferInfoGetter::GetInstance()->GetUniqueId(buffer_handle_);
+  if (unique_id && SwChainHasBuffer(*unique_id)) {
+    return;
+  }
+
+  pending_import_ = parent_->GetPipe().device->GetFbImportWorker().Enqueue(
+      buffer_handle_);
+}
+
 void HwcLayer::ImportFb() {
   if (!IsLayerUsableAsDevice() || !buffer_handle_updated_) {
     return;
@@ -211,24 +340,29 @@ void HwcLayer::ImportFb() {
   layer_data_.fb = {};
 
   auto unique_id = BufferInfoGetter::GetInstance()->GetUniqueId(buffer_handle_);
+  /* The unused import is kept until the next buffer replaces it */
   if (unique_id && SwChainGetBufferFromCache(*unique_id)) {
     return;
   }
 
-  layer_data_.bi = BufferInfoGetter::GetInstance()->GetBoInfo(buffer_handle_);
+  FbImportResult import;
+  if (pending_import_.valid()) {
+    // NOLINTNEXTLINE(misc-const-correctness)
+    ATRACE_NAME("WaitFbImport");
+    import = pending_import_.get();
+  } else {
+    import = DrmFbImportWorker::Import(*parent_->GetPipe().device,
+                                       buffer_handle_);
+  }
+
+  layer_data_.bi = std::move(import.bi);
   if (!layer_data_.bi) {
-    ALOGW("Unable to get buffer information (0x%p)", buffer_handle_);
     bi_get_failed_ = true;
     return;
   }
 
-  layer_data_
-      .fb = parent_->GetPipe().device->GetDrmFbImporter().GetOrCreateFbId(
-      &layer_data_.bi.value());
-
+  layer_data_.fb = std::move(import.fb);
   if (!layer_data_.fb) {
-    ALOGV("Unable to create framebuffer object for buffer 0x%p",
-          buffer_handle_);
     fb_import_failed_ = true;
     return;
   }
@@ -259,73 +393,51 @@ void HwcLayer::PopulateLayerData() {
 
 /* SwapChain Cache */
 
-bool HwcLayer::SwChainGetBufferFromCache(BufferUniqueId unique_id) {
-  if (swchain_lookup_table_.count(unique_id) == 0) {
-    return false;
+auto HwcLayer::SwChainFind(BufferUniqueId unique_id) -> SwapChainElement * {
+  for (auto &el : swchain_cache_) {
+    if (el.bi && el.unique_id == unique_id) {
+      return &el;
+    }
   }
 
-  auto seq = swchain_lookup_table_[unique_id];
+  return nullptr;
+}
 
-  if (swchain_cache_.count(seq) == 0) {
-    return false;
-  }
+bool HwcLayer::SwChainHasBuffer(BufferUniqueId unique_id) {
+  return SwChainFind(unique_id) != nullptr;
+}
 
-  auto& el = swchain_cache_[seq];
-  if (!el.bi) {
+bool HwcLayer::SwChainGetBufferFromCache(BufferUniqueId unique_id) {
+  auto *el = SwChainFind(unique_id);
+  if (el == nullptr) {
     return false;
   }
 
-  layer_data_.bi = el.bi;
-  layer_data_.fb = el.fb;
+  el->last_used = ++swchain_use_count_;
+  layer_data_.bi = el->bi;
+  layer_data_.fb = el->fb;
 
   return true;
 }
 
-void HwcLayer::SwChainReassemble(BufferUniqueId unique_id) {
-  if (swchain_lookup_table_.count(unique_id) != 0) {
-    if (swchain_lookup_table_[unique_id] ==
-        int(swchain_lookup_table_.size()) - 1) {
-      /* Skip same buffer */
-      return;
-    }
-    if (swchain_lookup_table_[unique_id] == 0) {
-      swchain_reassembled_ = true;
-      return;
-    }
-    /* Tracking error */
-    SwChainClearCache();
-    return;
-  }
-
-  swchain_lookup_table_[unique_id] = int(swchain_lookup_table_.size());
-}
-
 void HwcLayer::SwChainAddCurrentBuffer(BufferUniqueId unique_id) {
-  if (!swchain_reassembled_) {
-    SwChainReassemble(unique_id);
+  auto *el = SwChainFind(unique_id);
+  if (el == nullptr) {
+    /* Empty elements have last_used == 0 and are taken first */
+    el = &*std::min_element(swchain_cache_.begin(), swchain_cache_.end(),
+                            [](const auto &a, const auto &b) {
+                              return a.last_used < b.last_used;
+                            });
   }
 
-  if (swchain_reassembled_) {
-    if (swchain_lookup_table_.count(unique_id) == 0) {
-      SwChainClearCache();
-      return;
-    }
-
-    auto seq = swchain_lookup_table_[unique_id];
-
-    if (swchain_cache_.count(seq) == 0) {
-      swchain_cache_[seq] = {};
-    }
-
-    swchain_cache_[seq].bi = layer_data_.bi;
-    swchain_cache_[seq].fb = layer_data_.fb;
-  }
+  el->unique_id = unique_id;
+  el->bi = layer_data_.bi;
+  el->fb = layer_data_.fb;
+  el->last_used = ++swchain_use_count_;
 }
 
 void HwcLayer::SwChainClearCache() {
-  swchain_cache_.clear();
-  swchain_lookup_table_.clear();
-  swchain_reassembled_ = false;
+  swchain_cache_ = {};
 }
 
 }  // namespace android
\ No newline at end of file
@@ -19,8 +19,14 @@
 #include <aidl/android/hardware/graphics/common/Transform.h>
 #include <hardware/hwcomposer2.h>
 
+#include <array>
+#include <cstdint>
+#include <future>
+#include <vector>
+
 #include "bufferinfo/BufferInfoGetter.h"
 #include "compositor/LayerData.h"
+#include "drm/DrmFbImportWorker.h"
 
 namespace android {
 
@@ -32,6 +38,17 @@ class HwcLayer {
     buffer_handle_t buffer_handle;
     SharedFd acquire_fence;
   };
+  /* Layer state changed since the last validation */
+  enum DirtyBits : uint32_t {
+    kDirtyBuffer = 1 << 0,
+    kDirtyGeometry = 1 << 1, /* display frame, source crop, transform */
+    kDirtyBlending = 1 << 2, /* blend mode, plane alpha */
+    kDirtyZOrder = 1 << 3,
+    kDirtyDataspace = 1 << 4,
+    kDirtyCompositionType = 1 << 5,
+    kDirtyAll = (1 << 6) - 1,
+  };
+
   // A set of properties to be validated.
   struct LayerProperties {
     std::optional<Buffer> buffer;
@@ -44,9 +61,20 @@ class HwcLayer {
     std::optional<hwc_frect_t> source_crop;
     std::optional<LayerTransform> transform;
     std::optional<uint32_t> z_order;
+    std::optional<std::vector<hwc_rect_t>> damage;
+    std::optional<std::vector<hwc_rect_t>> visible_region;
   };
 
   explicit HwcLayer(HwcDisplay *parent_display) : parent_(parent_display){};
+  HwcLayer(HwcLayer &&) = default;
+  HwcLayer(const HwcLayer &) = delete;
+  HwcLayer &operator=(const HwcLayer &) = delete;
+
+  ~HwcLayer() {
+    /* The buffer handle may be released right after the layer is destroyed */
+    if (pending_import_.valid())
+      pending_import_.wait();
+  }
 
   HWC2::Composition GetSfType() const {
     return sf_type_;
@@ -80,7 +108,15 @@ class HwcLayer {
     return layer_data_;
   }
 
-  void SetLayerProperties(const LayerProperties &layer_properties);
+  /* The regions are moved out of |layer_properties| */
+  void SetLayerProperties(LayerProperties layer_properties);
+
+  uint32_t GetDirtyBits() const {
+    return dirty_;
+  }
+  void ClearDirtyBits() {
+    dirty_ = 0;
+  }
 
   // HWC2 Layer hooks
   HWC2::Error SetCursorPosition(int32_t /*x*/, int32_t /*y*/);
@@ -122,8 +158,44 @@ class HwcLayer {
 
   bool prior_buffer_scanout_flag_{};
 
+  uint32_t dirty_ = kDirtyAll;
+
   HwcDisplay *const parent_;
 
+  /* Content updates, used by the flattening policy */
+ public:
+  /* Consumes the buffer updates since the previous frame. Returns true if the
+   * visible content of the layer has changed.
+   */
+  bool CommitContentUpdate(int64_t now_ns, int64_t frequent_interval_ns);
+
+  /* The last two content updates happened within the interval given to
+   * CommitContentUpdate(), e.g. a blinking cursor or a clock.
+   */
+  bool IsFrequentlyUpdated() const {
+    return frequently_updated_;
+  }
+
+  /* The content has changed in the last committed frame */
+  bool IsContentUpdated() const {
+    return content_updated_;
+  }
+
+ private:
+  void UpdateZOrder(uint32_t z_order);
+  bool IsDamageEmpty() const;
+  bool IsVisible() const;
+
+  /* Empty vector means the whole buffer is damaged */
+  std::vector<hwc_rect_t> damage_;
+  /* Unknown until the client sets it, the layer is assumed to be visible */
+  std::optional<std::vector<hwc_rect_t>> visible_region_;
+  bool buffer_updated_{};
+  bool content_updated_{};
+  bool frequently_updated_{};
+  int64_t last_update_ns_{};
+  int64_t update_interval_ns_ = INT64_MAX;
+
   /* Layer state */
  public:
   void PopulateLayerData();
@@ -134,6 +206,9 @@ class HwcLayer {
 
  private:
   void ImportFb();
+  /* Starts the import in the background as soon as the buffer is set */
+  void RequestFbImport();
+  std::future<FbImportResult> pending_import_;
   bool bi_get_failed_{};
   bool fb_import_failed_{};
 
@@ -142,18 +217,26 @@ class HwcLayer {
   void SwChainClearCache();
 
  private:
+  /* Covers the typical BufferQueue depth. The buffers are looked up by their
+   * unique id, so the producer can drop or reorder them. The least recently
+   * used element is replaced when a new buffer arrives.
+   */
+  static constexpr size_t kSwChainCapacity = 8;
+
   struct SwapChainElement {
+    BufferUniqueId unique_id{};
     std::optional<BufferInfo> bi;
     std::shared_ptr<DrmFbIdHandle> fb;
+    uint64_t last_used{};
   };
 
+  auto SwChainFind(BufferUniqueId unique_id) -> SwapChainElement *;
+  bool SwChainHasBuffer(BufferUniqueId unique_id);
   bool SwChainGetBufferFromCache(BufferUniqueId unique_id);
-  void SwChainReassemble(BufferUniqueId unique_id);
   void SwChainAddCurrentBuffer(BufferUniqueId unique_id);
 
-  std::map<int /*seq_no*/, SwapChainElement> swchain_cache_;
-  std::map<BufferUniqueId, int /*seq_no*/> swchain_lookup_table_;
-  bool swchain_reassembled_{};
+  std::array<SwapChainElement, kSwChainCapacity> swchain_cache_;
+  uint64_t swchain_use_count_{};
 };
 
 }  // namespace android
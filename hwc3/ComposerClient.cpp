@@ -251,6 +251,21 @@ std::optional<hwc_rect> AidlToRect(const std::optional<common::Rect>& rect) {
   return hwc_rect{rect->left, rect->top, rect->right, rect->bottom};
 }
 
+std::optional<std::vector<hwc_rect>> AidlToRegion(
+    const std::optional<std::vector<std::optional<common::Rect>>>& region) {
+  if (!region) {
+    return std::nullopt;
+  }
+  std::vector<hwc_rect> rects;
+  rects.reserve(region->size());
+  for (const auto& rect : *region) {
+    if (rect) {
+      rects.emplace_back(*AidlToRect(rect));
+    }
+  }
+  return rects;
+}
+
 std::optional<hwc_frect> AidlToFRect(const std::optional<common::FRect>& rect) {
   if (!rect) {
     return std::nullopt;
@@ -304,6 +319,8 @@ std::optional<LayerTransform> AidlToLayerTransform(
 
 }  // namespace
 
+thread_local CommandResultWriter* ComposerClient::cmd_result_writer_ = nullptr;
+
 ComposerClient::ComposerClient() {
   DEBUG_FUNC();
 }
@@ -331,9 +348,9 @@ ndk::ScopedAStatus ComposerClient::createLayer(int64_t display_id,
                                                int32_t buffer_slot_count,
                                                int64_t* layer_id) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
+  auto locked = hwc_->LockDisplay(display_id);
 
-  HwcDisplay* display = GetDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -388,8 +405,8 @@ ndk::ScopedAStatus ComposerClient::createVirtualDisplay(
 ndk::ScopedAStatus ComposerClient::destroyLayer(int64_t display_id,
                                                 int64_t layer_id) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -521,15 +538,10 @@ hwc3::Error ComposerClient::PresentDisplayInternal(
   return hwc_->GetDisplay(display_id);
 }
 
-void ComposerClient::DispatchLayerCommand(int64_t display_id,
+void ComposerClient::DispatchLayerCommand(HwcDisplay& display,
+                                          int64_t display_id,
                                           const LayerCommand& command) {
-  auto* display = GetDisplay(display_id);
-  if (display == nullptr) {
-    cmd_result_writer_->AddError(hwc3::Error::kBadDisplay);
-    return;
-  }
-
-  auto* layer = display->get_layer(command.layer);
+  auto* layer = display.get_layer(Hwc3LayerToHwc2(command.layer));
   if (layer == nullptr) {
     cmd_result_writer_->AddError(hwc3::Error::kBadLayer);
     return;
@@ -549,11 +561,15 @@ void ComposerClient::DispatchLayerCommand(int64_t display_id,
     return;
   }
 
+  /* The replaced buffer is freed on return, after the layer has stopped
+   * importing it in SetLayerProperties()
+   */
+  auto releaser = ComposerResources::CreateResourceReleaser(true);
   HwcLayer::LayerProperties properties;
   if (command.buffer) {
     HwcLayer::Buffer buffer;
     auto err = ImportLayerBuffer(display_id, command.layer, *command.buffer,
-                                 &buffer.buffer_handle);
+                                 &buffer.buffer_handle, releaser.get());
     if (err != hwc3::Error::kNone) {
       cmd_result_writer_->AddError(err);
       return;
@@ -572,8 +588,10 @@ void ComposerClient::DispatchLayerCommand(int64_t display_id,
   properties.source_crop = AidlToFRect(command.sourceCrop);
   properties.transform = AidlToLayerTransform(command.transform);
   properties.z_order = AidlToZOrder(command.z);
+  properties.damage = AidlToRegion(command.damage);
+  properties.visible_region = AidlToRegion(command.visibleRegion);
 
-  layer->SetLayerProperties(properties);
+  layer->SetLayerProperties(std::move(properties));
 
   // Some unsupported functionality returns kUnsupported, and others
   // are just a no-op.
@@ -583,8 +601,6 @@ void ComposerClient::DispatchLayerCommand(int64_t display_id,
     cmd_result_writer_->AddError(hwc3::Error::kUnsupported);
   }
   // TODO: Blocking region handling missing.
-  // TODO: Layer surface damage.
-  // TODO: Layer visible region.
   // TODO: Per-frame metadata.
   // TODO: Layer color transform.
   // TODO: Layer cursor position.
@@ -593,7 +609,9 @@ void ComposerClient::DispatchLayerCommand(int64_t display_id,
 
 void ComposerClient::ExecuteDisplayCommand(const DisplayCommand& command) {
   const int64_t display_id = command.display;
-  if (hwc_->GetDisplay(display_id) == nullptr) {
+  /* Held for the whole command, the other displays are composed meanwhile */
+  auto locked = hwc_->LockDisplay(display_id);
+  if (!locked.display) {
     cmd_result_writer_->AddError(hwc3::Error::kBadDisplay);
     return;
   }
@@ -605,7 +623,7 @@ void ComposerClient::ExecuteDisplayCommand(const DisplayCommand& command) {
   }
 
   for (const auto& layer_cmd : command.layers) {
-    DispatchLayerCommand(command.display, layer_cmd);
+    DispatchLayerCommand(*locked.display, display_id, layer_cmd);
   }
 
   if (command.colorTransformMatrix) {
@@ -637,14 +655,14 @@ void ComposerClient::ExecuteDisplayCommand(const DisplayCommand& command) {
 ndk::ScopedAStatus ComposerClient::executeCommands(
     const std::vector<DisplayCommand>& commands,
     std::vector<CommandResultPayload>* results) {
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
   DEBUG_FUNC();
-  cmd_result_writer_ = std::make_unique<CommandResultWriter>(results);
+  CommandResultWriter writer(results);
+  cmd_result_writer_ = &writer;
   for (const auto& cmd : commands) {
     ExecuteDisplayCommand(cmd);
-    cmd_result_writer_->IncrementCommand();
+    writer.IncrementCommand();
   }
-  cmd_result_writer_.reset();
+  cmd_result_writer_ = nullptr;
 
   return ndk::ScopedAStatus::ok();
 }
@@ -652,8 +670,8 @@ ndk::ScopedAStatus ComposerClient::executeCommands(
 ndk::ScopedAStatus ComposerClient::getActiveConfig(int64_t display_id,
                                                    int32_t* config_id) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -670,8 +688,8 @@ ndk::ScopedAStatus ComposerClient::getActiveConfig(int64_t display_id,
 ndk::ScopedAStatus ComposerClient::getColorModes(
     int64_t display_id, std::vector<ColorMode>* color_modes) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -714,8 +732,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayAttribute(
     int64_t display_id, int32_t config_id, DisplayAttribute attribute,
     int32_t* value) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -765,8 +783,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayAttribute(
 ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(
     int64_t display_id, std::vector<DisplayCapability>* caps) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -795,8 +813,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(
 ndk::ScopedAStatus ComposerClient::getDisplayConfigs(
     int64_t display_id, std::vector<int32_t>* out_configs) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -811,8 +829,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayConfigs(
 ndk::ScopedAStatus ComposerClient::getDisplayConnectionType(
     int64_t display_id, DisplayConnectionType* type) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -831,8 +849,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayConnectionType(
 ndk::ScopedAStatus ComposerClient::getDisplayIdentificationData(
     int64_t display_id, DisplayIdentification* id) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -860,8 +878,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayIdentificationData(
 ndk::ScopedAStatus ComposerClient::getDisplayName(int64_t display_id,
                                                   std::string* name) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -880,8 +898,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayName(int64_t display_id,
 ndk::ScopedAStatus ComposerClient::getDisplayVsyncPeriod(
     int64_t display_id, int32_t* vsync_period) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -894,7 +912,10 @@ ndk::ScopedAStatus ComposerClient::getDisplayVsyncPeriod(
     return ToBinderStatus(hwc3::Error::kBadConfig);
   }
 
-  *vsync_period = config->mode.GetVSyncPeriodNs();
+  /* Measured period of the current config if available */
+  uint32_t period_ns = config->mode.GetVSyncPeriodNs();
+  display->GetDisplayVsyncPeriod(&period_ns);
+  *vsync_period = static_cast<int32_t>(period_ns);
   return ndk::ScopedAStatus::ok();
 }
 
@@ -920,8 +941,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayPhysicalOrientation(
     return ToBinderStatus(hwc3::Error::kBadParameter);
   }
 
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -954,8 +975,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayPhysicalOrientation(
 ndk::ScopedAStatus ComposerClient::getHdrCapabilities(int64_t display_id,
                                                       HdrCapabilities* caps) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -993,8 +1014,8 @@ ndk::ScopedAStatus ComposerClient::getReadbackBufferFence(
 ndk::ScopedAStatus ComposerClient::getRenderIntents(
     int64_t display_id, ColorMode mode, std::vector<RenderIntent>* intents) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1025,8 +1046,8 @@ ndk::ScopedAStatus ComposerClient::getRenderIntents(
 ndk::ScopedAStatus ComposerClient::getSupportedContentTypes(
     int64_t display_id, std::vector<ContentType>* types) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1070,8 +1091,8 @@ ndk::ScopedAStatus ComposerClient::setActiveConfigWithConstraints(
     const VsyncPeriodChangeConstraints& constraints,
     VsyncPeriodChangeTimeline* timeline) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1140,8 +1161,8 @@ ndk::ScopedAStatus ComposerClient::getPreferredBootDisplayConfig(
 ndk::ScopedAStatus ComposerClient::setAutoLowLatencyMode(int64_t display_id,
                                                          bool on) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1161,8 +1182,8 @@ ndk::ScopedAStatus ComposerClient::setColorMode(int64_t display_id,
                                                 ColorMode mode,
                                                 RenderIntent intent) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1175,8 +1196,8 @@ ndk::ScopedAStatus ComposerClient::setColorMode(int64_t display_id,
 ndk::ScopedAStatus ComposerClient::setContentType(int64_t display_id,
                                                   ContentType type) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1197,8 +1218,8 @@ ndk::ScopedAStatus ComposerClient::setDisplayedContentSamplingEnabled(
 ndk::ScopedAStatus ComposerClient::setPowerMode(int64_t display_id,
                                                 PowerMode mode) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1221,8 +1242,8 @@ ndk::ScopedAStatus ComposerClient::setReadbackBuffer(
 ndk::ScopedAStatus ComposerClient::setVsyncEnabled(int64_t display_id,
                                                    bool enabled) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1268,8 +1289,8 @@ ndk::ScopedAStatus ComposerClient::getDisplayConfigurations(
     int64_t display_id, int32_t /*max_frame_interval_ns*/,
     std::vector<DisplayConfiguration>* configurations) {
   DEBUG_FUNC();
-  const std::unique_lock lock(hwc_->GetResMan().GetMainLock());
-  HwcDisplay* display = GetDisplay(display_id);
+  auto locked = hwc_->LockDisplay(display_id);
+  HwcDisplay* display = locked.display.get();
   if (display == nullptr) {
     return ToBinderStatus(hwc3::Error::kBadDisplay);
   }
@@ -1307,13 +1328,11 @@ std::string ComposerClient::Dump() {
 
 hwc3::Error ComposerClient::ImportLayerBuffer(
     int64_t display_id, int64_t layer_id, const Buffer& buffer,
-    buffer_handle_t* out_imported_buffer) {
+    buffer_handle_t* out_imported_buffer, ComposerResourceReleaser* releaser) {
   *out_imported_buffer = nullptr;
 
-  auto releaser = composer_resources_->CreateResourceReleaser(true);
   auto err = composer_resources_->GetLayerBuffer(display_id, layer_id, buffer,
-                                                 out_imported_buffer,
-                                                 releaser.get());
+                                                 out_imported_buffer, releaser);
   return err;
 }
 
@@ -1410,24 +1429,20 @@ void ComposerClient::ExecuteSetDisplayOutputBuffer(uint64_t display_id,
 }
 void ComposerClient::ExecuteValidateDisplay(
     int64_t display_id,
-    std::optional<ClockMonotonicTimestamp> /*expected_present_time*/
-) {
+    std::optional<ClockMonotonicTimestamp> expected_present_time) {
   auto* display = GetDisplay(display_id);
   if (display == nullptr) {
     cmd_result_writer_->AddError(hwc3::Error::kBadDisplay);
     return;
   }
 
-  /* TODO: Handle expectedPresentTime */
-  /* This can be implemented in multiple ways. For example, the expected present
-   * time property can be implemented by the DRM driver directly as a CRTC
-   * property. See:
-   * https://cs.android.com/android/platform/superproject/main/+/b8b3b1646e64d0235f77b9e717a3e4082e26f2a8:hardware/google/graphics/common/libhwc2.1/libdrmresource/drm/drmcrtc.cpp;drc=468f6172546ab98983de18210222f231f16b21e1;l=88
-   * Unfortunately there doesn't seem to be a standardised way of delaying
-   * presentation with a timestamp in the DRM API. What we can do alternatively
-   * is to spawn a separate presentation thread that could handle the VBlank
-   * events by using DRM_MODE_PAGE_FLIP_EVENT and schedule them appropriately.
+  /* There is no standardised way of delaying the presentation in the DRM API,
+   * the present holds the frame until the vblank preceding the expected
+   * present time instead. See HwcDisplay::WaitForPresentTime().
    */
+  if (expected_present_time) {
+    display->SetExpectedPresentTime(expected_present_time->timestampNanos);
+  }
 
   std::vector<int64_t> changed_layers;
   std::vector<Composition> composition_types;
@@ -1516,18 +1531,27 @@ void ComposerClient::ExecutePresentOrValidateDisplay(
     return;
   }
 
-  /* TODO: Handle expectedPresentTime */
-  /* This can be implemented in multiple ways. For example, the expected present
-   * time property can be implemented by the DRM driver directly as a CRTC
-   * property. See:
-   * https://cs.android.com/android/platform/superproject/main/+/b8b3b1646e64d0235f77b9e717a3e4082e26f2a8:hardware/google/graphics/common/libhwc2.1/libdrmresource/drm/drmcrtc.cpp;drc=468f6172546ab98983de18210222f231f16b21e1;l=88
-   * Unfortunately there doesn't seem to be a standardised way of delaying
-   * presentation with a timestamp in the DRM API. What we can do alternatively
-   * is to spawn a separate presentation thread that could handle the VBlank
-   * events by using DRM_MODE_PAGE_FLIP_EVENT and schedule them appropriately.
-   */
+  if (expected_present_time) {
+    display->SetExpectedPresentTime(expected_present_time->timestampNanos);
+  }
+
+  /* Present right away if only buffers have changed since the last frame */
+  if (!composer_resources_->MustValidateDisplay(display_id) &&
+      display->SkipValidate()) {
+    ::android::base::unique_fd display_fence;
+    std::unordered_map<int64_t, ::android::base::unique_fd> release_fences;
+    auto error = PresentDisplayInternal(display_id, display_fence,
+                                        release_fences);
+    if (error == hwc3::Error::kNone) {
+      cmd_result_writer_->AddPresentFence(display_id, std::move(display_fence));
+      cmd_result_writer_->AddReleaseFence(display_id, release_fences);
+      cmd_result_writer_
+          ->AddPresentOrValidateResult(display_id,
+                                       PresentOrValidate::Result::Presented);
+      return;
+    }
+  }
 
-  /* TODO: Add check if it's possible to skip display validation */
   ExecuteValidateDisplay(display_id, expected_present_time);
   cmd_result_writer_
       ->AddPresentOrValidateResult(display_id,
@@ -163,10 +163,13 @@ class ComposerClient : public BnComposerClient {
  private:
   hwc3::Error ImportLayerBuffer(int64_t display_id, int64_t layer_id,
                                 const Buffer& buffer,
-                                buffer_handle_t* out_imported_buffer);
+                                buffer_handle_t* out_imported_buffer,
+                                ComposerResourceReleaser* releaser);
 
   // Layer commands
-  void DispatchLayerCommand(int64_t display_id, const LayerCommand& command);
+  /* Called with the display locked, once per layer of the batch */
+  void DispatchLayerCommand(::android::HwcDisplay& display, int64_t display_id,
+                            const LayerCommand& command);
 
   // Display commands
   void ExecuteDisplayCommand(const DisplayCommand& command);
@@ -200,7 +203,10 @@ class ComposerClient : public BnComposerClient {
 
   ::android::HwcDisplay* GetDisplay(uint64_t display_id);
 
-  std::unique_ptr<CommandResultWriter> cmd_result_writer_;
+  /* Set for the duration of executeCommands(), which may run concurrently
+   * for different displays.
+   */
+  static thread_local CommandResultWriter* cmd_result_writer_;
 
   // Manages importing and caching gralloc buffers for displays and layers.
   std::unique_ptr<ComposerResources> composer_resources_;
@@ -22,6 +22,7 @@
 
 #include <aidlcommonsupport/NativeHandle.h>
 
+#include "bufferinfo/BufferInfoGetter.h"
 #include "hardware/hwcomposer2.h"
 #include "hwc3/Utils.h"
 
@@ -39,6 +40,34 @@ namespace aidl::android::hardware::graphics::composer3::impl {
       layer_id);
 }
 
+/* Gets the handle of |buffer| through |get_handle(from_cache, in_handle,
+ * out_handle)|. A new handle replaces the one cached in the slot, which the
+ * releaser frees once the command is handled. The HAL releaser does not
+ * expose that handle, so it is read from the slot before the update, and
+ * its buffer info is dropped once the update succeeds.
+ */
+template <class GetHandle>
+static hwc3::Error GetSlotBuffer(const Buffer& buffer,
+                                 buffer_handle_t* out_handle,
+                                 GetHandle&& get_handle) {
+  if (!buffer.handle.has_value()) {
+    auto err = get_handle(/*from_cache=*/true, nullptr, out_handle);
+    return Hwc2toHwc3Error(static_cast<HWC2::Error>(err));
+  }
+
+  buffer_handle_t replaced = nullptr;
+  get_handle(/*from_cache=*/true, nullptr, &replaced);
+
+  auto err = get_handle(/*from_cache=*/false,
+                        ::android::makeFromAidl(*buffer.handle), out_handle);
+  auto hwc3_err = Hwc2toHwc3Error(static_cast<HWC2::Error>(err));
+  if (hwc3_err == hwc3::Error::kNone && replaced != nullptr) {
+    ::android::BufferInfoGetter::GetInstance()->InvalidateBoInfo(replaced);
+  }
+
+  return hwc3_err;
+}
+
 std::unique_ptr<ComposerResourceReleaser>
 ComposerResources::CreateResourceReleaser(bool is_buffer) {
   return std::make_unique<ComposerResourceReleaser>(is_buffer);
@@ -61,17 +90,14 @@ hwc3::Error ComposerResources::GetLayerBuffer(
   auto display = ToHwc2Display(display_id);
   auto layer = ToHwc2Layer(layer_id);
 
-  const bool use_cache = !buffer.handle.has_value();
-  buffer_handle_t buffer_handle = nullptr;
-  if (buffer.handle.has_value()) {
-    buffer_handle = ::android::makeFromAidl(*buffer.handle);
-  }
-
-  auto err = resources_->getLayerBuffer(display, layer, buffer.slot, use_cache,
-                                        buffer_handle, out_buffer_handle,
-                                        buf_releaser->GetReplacedHandle());
-
-  return Hwc2toHwc3Error(static_cast<HWC2::Error>(err));
+  return GetSlotBuffer(buffer, out_buffer_handle,
+                       [&](bool from_cache, buffer_handle_t in_handle,
+                           buffer_handle_t* out_handle) {
+                         return resources_->getLayerBuffer(
+                             display, layer, buffer.slot, from_cache,
+                             in_handle, out_handle,
+                             buf_releaser->GetReplacedHandle());
+                       });
 }
 
 hwc3::Error ComposerResources::GetLayerSidebandStream(
@@ -146,16 +172,13 @@ hwc3::Error ComposerResources::GetDisplayClientTarget(
     ComposerResourceReleaser* releaser) {
   auto display = ToHwc2Display(display_id);
 
-  const bool use_cache = !buffer.handle.has_value();
-  buffer_handle_t buffer_handle = nullptr;
-  if (buffer.handle.has_value()) {
-    buffer_handle = ::android::makeFromAidl(*buffer.handle);
-  }
-
-  auto err = resources_->getDisplayClientTarget(display, buffer.slot, use_cache,
-                                                buffer_handle, out_handle,
-                                                releaser->GetReplacedHandle());
-  return Hwc2toHwc3Error(static_cast<HWC2::Error>(err));
+  return GetSlotBuffer(buffer, out_handle,
+                       [&](bool from_cache, buffer_handle_t in_handle,
+                           buffer_handle_t* slot_handle) {
+                         return resources_->getDisplayClientTarget(
+                             display, buffer.slot, from_cache, in_handle,
+                             slot_handle, releaser->GetReplacedHandle());
+                       });
 }
 
 hwc3::Error ComposerResources::SetDisplayClientTargetCacheSize(
@@ -187,16 +210,13 @@ hwc3::Error ComposerResources::GetDisplayOutputBuffer(
     uint64_t display_id, const Buffer& buffer, buffer_handle_t* out_handle,
     ComposerResourceReleaser* releaser) {
   auto display = ToHwc2Display(display_id);
-  const bool use_cache = !buffer.handle.has_value();
-
-  buffer_handle_t buffer_handle = nullptr;
-  if (buffer.handle.has_value()) {
-    buffer_handle = ::android::makeFromAidl(*buffer.handle);
-  }
 
-  auto err = resources_->getDisplayOutputBuffer(display, buffer.slot, use_cache,
-                                                buffer_handle, out_handle,
-                                                releaser->GetReplacedHandle());
-  return Hwc2toHwc3Error(static_cast<HWC2::Error>(err));
+  return GetSlotBuffer(buffer, out_handle,
+                       [&](bool from_cache, buffer_handle_t in_handle,
+                           buffer_handle_t* slot_handle) {
+                         return resources_->getDisplayOutputBuffer(
+                             display, buffer.slot, from_cache, in_handle,
+                             slot_handle, releaser->GetReplacedHandle());
+                       });
 }
 }  // namespace aidl::android::hardware::graphics::composer3::impl
\ No newline at end of file
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace android {
+
+/* Flat table of objects addressed by 64-bit handles. The lower half of a
+ * handle is the slot index, the upper half is the generation of the slot,
+ * bumped every time the slot is freed, so a stale handle never reaches the
+ * object that reuses the slot.
+ *
+ * Lookups are a bounds check and a compare. The freed slots are reused
+ * first, the storage only grows with the peak object count. Iteration
+ * yields std::pair<const uint64_t, T> like std::map, in slot order.
+ * Insertion may move the objects.
+ */
+template <class T>
+class SlotMap {
+ public:
+  using Handle = uint64_t;
+  using value_type = std::pair<const Handle, T>;
+
+  template <class... Args>
+  auto Emplace(Args &&...args) -> Handle {
+    uint32_t index = 0;
+    if (!free_.empty()) {
+      index = free_.back();
+      free_.pop_back();
+    } else {
+      index = static_cast<uint32_t>(slots_.size());
+      slots_.emplace_back();
+    }
+
+    auto &slot = slots_[index];
+    auto handle = MakeHandle(index, slot.generation);
+    slot.entry.emplace(std::piecewise_construct, std::forward_as_tuple(handle),
+                       std::forward_as_tuple(std::forward<Args>(args)...));
+    count_++;
+    return handle;
+  }
+
+  auto Find(Handle handle) -> T * {
+    auto index = static_cast<uint32_t>(handle);
+    if (index >= slots_.size())
+      return nullptr;
+
+    auto &slot = slots_[index];
+    if (!slot.entry || slot.entry->first != handle)
+      return nullptr;
+
+    return &slot.entry->second;
+  }
+
+  auto Erase(Handle handle) -> bool {
+    if (Find(handle) == nullptr)
+      return false;
+
+    auto index = static_cast<uint32_t>(handle);
+    auto &slot = slots_[index];
+    slot.entry.reset();
+    slot.generation = (slot.generation + 1) & kGenerationMask;
+    free_.emplace_back(index);
+    count_--;
+    return true;
+  }
+
+  auto size() const {
+    return count_;
+  }
+
+  auto empty() const {
+    return count_ == 0;
+  }
+
+  template <class Slots, class Value>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Value;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Value *;
+    using reference = Value &;
+
+    Iterator(Slots *slots, size_t index) : slots_(slots), index_(index) {
+      SkipFree();
+    }
+
+    auto operator*() const -> reference {
+      return *(*slots_)[index_].entry;
+    }
+    auto operator->() const -> pointer {
+      return &*(*slots_)[index_].entry;
+    }
+    auto operator++() -> Iterator & {
+      index_++;
+      SkipFree();
+      return *this;
+    }
+    bool operator==(const Iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const Iterator &other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    void SkipFree() {
+      while (index_ < slots_->size() && !(*slots_)[index_].entry)
+        index_++;
+    }
+
+    Slots *slots_;
+    size_t index_;
+  };
+
+  auto begin() {
+    return Iterator<Slots, value_type>(&slots_, 0);
+  }
+  auto end() {
+    return Iterator<Slots, value_type>(&slots_, slots_.size());
+  }
+  auto begin() const {
+    return Iterator<const Slots, const value_type>(&slots_, 0);
+  }
+  auto end() const {
+    return Iterator<const Slots, const value_type>(&slots_, slots_.size());
+  }
+
+ private:
+  /* Keeps the handles positive when passed as the signed HWC3 layer ids */
+  static constexpr uint32_t kGenerationMask = 0x7fffffff;
+
+  struct Slot {
+    std::optional<value_type> entry;
+    uint32_t generation{};
+  };
+  using Slots = std::vector<Slot>;
+
+  static auto MakeHandle(uint32_t index, uint32_t generation) -> Handle {
+    return (Handle(generation) << 32) | index;
+  }
+
+  Slots slots_;
+  std::vector<uint32_t> free_;
+  size_t count_{};
+};
+
+}  // namespace android
@@ -16,6 +16,19 @@
 
 #include "properties.h"
 
+#include <cstdlib>
+
+static auto PropertyGetUint(const char *key, uint64_t default_value)
+    -> uint64_t {
+  char buf[PROPERTY_VALUE_MAX] = {};
+  if (property_get(key, buf, "") <= 0)
+    return default_value;
+
+  char *end = nullptr;
+  auto value = strtoull(buf, &end, 0);
+  return (end == buf || *end != '\0') ? default_value : value;
+}
+
 /**
  * @brief Determine if the "Present Not Reliable" property is enabled.
  *
@@ -41,3 +54,17 @@ auto Properties::ScaleWithGpu() -> bool {
 auto Properties::EnableVirtualDisplay() -> bool {
   return (property_get_bool("vendor.hwc.drm.enable_virtual_display", 0) != 0);
 }
+
+/* Number of recently used framebuffers, kept alive after their buffers are
+ * no longer used by any layer. 0 disables the strong reference cache.
+ */
+auto Properties::FbCacheMaxEntries() -> uint32_t {
+  constexpr uint64_t kDefaultEntries = 16;
+  return uint32_t(PropertyGetUint("vendor.hwc.drm.fb_cache_entries",
+                                  kDefaultEntries));
+}
+
+auto Properties::FbCacheMaxBytes() -> uint64_t {
+  constexpr uint64_t kDefaultBytes = 64ULL * 1024 * 1024;
+  return PropertyGetUint("vendor.hwc.drm.fb_cache_bytes", kDefaultBytes);
+}
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 #ifdef ANDROID
 
 #include <cutils/properties.h>
@@ -81,4 +83,6 @@ class Properties {
   static auto UseOverlayPlanes() -> bool;
   static auto ScaleWithGpu() -> bool;
   static auto EnableVirtualDisplay() -> bool;
+  static auto FbCacheMaxEntries() -> uint32_t;
+  static auto FbCacheMaxBytes() -> uint64_t;
 };